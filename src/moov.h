@@ -27,8 +27,14 @@ struct mp4_split_options_t {
     // add adbr
     int adbr;
     int org;
-    int video_resolution;
+    ngx_http_estreaming_rendition_t *rendition;
+    ngx_estreaming_rung_t rate; // of the rendition for this title
+    int hevc; // codec=hevc or .m4s: the fMP4 variant of the rendition
+    int init; // the EXT-X-MAP segment of that variant
     char *hash;
+    ngx_uint_t length; // segment_length of this request, length= or the configured one
+    uint64_t clip_from; // clipFrom= in msec, 0 = start of the file
+    uint64_t clip_to; // clipTo= in msec, 0 = end of the file
 };
 typedef struct mp4_split_options_t mp4_split_options_t;
 
@@ -149,6 +155,19 @@ static int get_aligned_start_and_end(struct mp4_context_t const *mp4_context,
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static ngx_http_estreaming_rendition_t *find_rendition(hls_conf_t const *conf,
+        const char *name, size_t len) {
+    ngx_uint_t i;
+    ngx_http_estreaming_rendition_t *rendition = conf->renditions->elts;
+    for (i = 0; i < conf->renditions->nelts; i++) {
+        if (rendition[i].name.len == len
+                && ngx_strncmp(rendition[i].name.data, name, len) == 0) {
+            return &rendition[i];
+        }
+    }
+    return NULL;
+}
+
 mp4_split_options_t *mp4_split_options_init(ngx_http_request_t *r) {
     mp4_split_options_t *options = (mp4_split_options_t *) ngx_pcalloc(r->pool, sizeof (mp4_split_options_t));
     options->start = 0.0;
@@ -160,101 +179,180 @@ mp4_split_options_t *mp4_split_options_init(ngx_http_request_t *r) {
     options->fragment_track_id = 0;
     options->fragment_start = 0;
     options->hash = NULL;
+    options->rate.preset = -1;
+    options->length = ((hls_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_estreaming_module))->length;
 
     return options;
 }
 
+/* digits with an optional fraction, args are not zero terminated */
+static double mp4_arg_double(u_char const *p, size_t len) {
+    double v = 0, scale = 1;
+    ngx_uint_t dot = 0;
+
+    for (; len; len--, p++) {
+        if (*p == '.' && !dot) {
+            dot = 1;
+        } else if (*p < '0' || *p > '9') {
+            break;
+        } else if (dot) {
+            scale /= 10;
+            v += (*p - '0') * scale;
+        } else {
+            v = v * 10 + (*p - '0');
+        }
+    }
+    return v;
+}
+
+static uint64_t mp4_arg_integer(u_char const *p, size_t len) {
+    uint64_t v = 0;
+    for (; len && *p >= '0' && *p <= '9'; len--, p++) v = v * 10 + (*p - '0');
+    return v;
+}
+
+/* length= only takes segment_length or one of streaming_segment_lengths */
+static int mp4_split_options_length(hls_conf_t const *conf, ngx_uint_t length) {
+    ngx_uint_t i, *lengths;
+
+    if (length == conf->length) return 1;
+    if (conf->lengths == NULL) return 0;
+    lengths = conf->lengths->elts;
+    for (i = 0; i < conf->lengths->nelts; i++) {
+        if (lengths[i] == length) return 1;
+    }
+    return 0;
+}
+
+#define mp4_arg_is(s, len, name) \
+    ((len) == sizeof (name) - 1 && ngx_strncmp(s, name, sizeof (name) - 1) == 0)
+
 int mp4_split_options_set(ngx_http_request_t *r, struct mp4_split_options_t *options,
         const char *args_data,
         unsigned int args_size) {
-    int result = 1;
-
-    {
-        hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_estreaming_module);
-        const char *first = args_data;
-        const char *last = first + args_size + 1;
-
-        if (*first == '?') ++first;
-
-        {
-            char const *key = first;
-            char const *val = NULL;
-            int is_key = 1;
-            size_t key_len = 0;
-
-            while (first != last) {
-                // the args_data is not necessarily 0 terminated, so fake it
-                int ch = (first == last - 1) ? '\0' : *first;
-                switch (ch) {
-                    case '=':
-                        val = first + 1;
-                        key_len = first - key;
-                        is_key = 0;
-                        break;
-                    case '&':
-                    case '\0':
-                        if (!is_key) {
-                            // make sure the value is zero-terminated (for strtod,atoi64)
-                            int val_len = first - val;
-                            char *valz = (char *) malloc(val_len + 1);
-                            memcpy(valz, val, val_len);
-                            valz[val_len] = '\0';
-
-                            if (!strncmp("start", key, key_len)) {
-                                options->start = (float) (strtod(valz, NULL));
-                                options->start_integer = atoi64(valz);
-                            } else if (!strncmp("end", key, key_len)) {
-                                options->end = (float) (strtod(valz, NULL));
-                            } else if (!strncmp("bitrate", key, key_len)) {
-                                options->fragment_bitrate = (unsigned int) (atoi64(valz));
-                            } else if (!strncmp("org", key, key_len)) {
-                                if (!strncmp("true", val, val_len)) {
-                                    options->org = 1;
-                                }
-                            } else if (!strncmp("video", key, key_len)) {
-                                options->fragments = 1;
-                                options->fragment_start = atoi64(valz);
-                            } else if (!strncmp("audio", key, key_len)) {
-                                options->fragment_track_id = atoi64(valz);
-                            } else if (!strncmp("length", key, key_len)) {
-                                conf->length = (ngx_uint_t) atoi64(valz);
-                            } else if (!strncmp("hash", key, key_len)) {
-                                if (val_len > 16) {
-                                    val_len = 16;
-                                    valz[val_len] = 0;
-                                }
-                                options->hash = ngx_pcalloc(r->pool, val_len + 1);
-                                strcpy(options->hash, valz);
-                            } else if (!strncmp("input", key, key_len)) {
-                                if (!strncmp("flv", val, val_len)) {
-                                    options->input_format = INPUT_FORMAT_FLV;
-                                }
-                            } else if (!strncmp("vr", key, key_len)) {
-                                if (!strncmp("360p", val, val_len)) {
-                                    options->video_resolution = 1; //360p
-                                } else if (!strncmp("480p", val, val_len)) {
-                                    options->video_resolution = 2; //480p
-                                } else if (!strncmp("720p", val, val_len)) {
-                                    options->video_resolution = 3; //720p
-                                }
-                            } else if (!strncmp("adbr", key, key_len)) {
-                                if (!strncmp("true", val, val_len)) {
-                                    options->adbr = 1;
-                                }
-                            }
-                            free(valz);
-                        }
-                        key = first + 1;
-                        val = NULL;
-                        is_key = 1;
-                        break;
-                }
-                ++first;
-            }
+    hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_estreaming_module);
+    u_char *p = (u_char *) args_data, *last = p + args_size, *key, *val, *end;
+    size_t key_len, val_len;
+
+    if (p != last && *p == '?') ++p;
+    for (; p < last; p = end + 1) {
+        key = p;
+        end = ngx_strlchr(p, last, '&');
+        if (end == NULL) end = last;
+        val = ngx_strlchr(key, end, '=');
+        if (val == NULL) continue;
+        key_len = val - key;
+        val_len = end - ++val;
+
+        if (mp4_arg_is(key, key_len, "start")) {
+            options->start = (float) mp4_arg_double(val, val_len);
+            options->start_integer = mp4_arg_integer(val, val_len);
+        } else if (mp4_arg_is(key, key_len, "end")) {
+            options->end = (float) mp4_arg_double(val, val_len);
+        } else if (mp4_arg_is(key, key_len, "bitrate")) {
+            options->fragment_bitrate = (uint32_t) mp4_arg_integer(val, val_len);
+        } else if (mp4_arg_is(key, key_len, "org")) {
+            if (mp4_arg_is(val, val_len, "true")) options->org = 1;
+        } else if (mp4_arg_is(key, key_len, "video")) {
+            options->fragments = 1;
+            options->fragment_start = mp4_arg_integer(val, val_len);
+        } else if (mp4_arg_is(key, key_len, "audio")) {
+            options->fragment_track_id = (uint32_t) mp4_arg_integer(val, val_len);
+        } else if (mp4_arg_is(key, key_len, "length")) {
+            options->length = (ngx_uint_t) mp4_arg_integer(val, val_len);
+        } else if (mp4_arg_is(key, key_len, "clipFrom")) {
+            options->clip_from = mp4_arg_integer(val, val_len);
+        } else if (mp4_arg_is(key, key_len, "clipTo")) {
+            options->clip_to = mp4_arg_integer(val, val_len);
+        } else if (mp4_arg_is(key, key_len, "hash")) {
+            if (val_len > 16) val_len = 16;
+            options->hash = ngx_pnalloc(r->pool, val_len + 1);
+            if (options->hash == NULL) return 0;
+            ngx_memcpy(options->hash, val, val_len);
+            options->hash[val_len] = '\0';
+        } else if (mp4_arg_is(key, key_len, "input")) {
+            if (mp4_arg_is(val, val_len, "flv")) options->input_format = INPUT_FORMAT_FLV;
+        } else if (mp4_arg_is(key, key_len, "codec")) {
+            if (mp4_arg_is(val, val_len, "hevc")) options->hevc = 1;
+        } else if (mp4_arg_is(key, key_len, "vr")) {
+            options->rendition = find_rendition(conf, (char const *) val, val_len);
+        } else if (mp4_arg_is(key, key_len, "adbr")) {
+            if (mp4_arg_is(val, val_len, "true")) options->adbr = 1;
         }
     }
+    /* unknown or missing vr falls back to the first configured rung */
+    if (options->adbr && options->rendition == NULL && conf->renditions->nelts) {
+        options->rendition = conf->renditions->elts;
+    }
+    return 1;
+}
 
-    return result;
+/*
+ * the URL layout playlists are written with, parsed without rewrite rules:
+ *   .../adbr/<rendition>[/hevc][/<segment>]/<name>.<ext>
+ *   .../org[/<rendition>][/<segment>]/<name>.<ext>
+ *   .../<segment>/<name>.<ts|m4s>
+ * on return uri is the one of the mp4 itself, .../<name>.<ext>; the handler
+ * maps r->uri as it is when there is no such mp4, directories may be named so
+ * NGX_DECLINED: an org rendition which is not configured
+ */
+static ngx_int_t mp4_split_options_uri(ngx_http_request_t *r, struct mp4_split_options_t *options,
+        ngx_str_t *uri) {
+    hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_estreaming_module);
+    u_char *base = uri->data, *end = uri->data + uri->len, *name, *p;
+    ngx_str_t c[4]; // c[0] is the directory the name is in
+    ngx_uint_t n, i = 0;
+    ngx_int_t segment = NGX_ERROR;
+    size_t len;
+
+    for (name = end; name > base && name[-1] != '/'; name--) { /* void */ }
+    for (n = 0, p = name - 1; n < 4 && p > base; n++, p = c[n - 1].data - 1) {
+        for (c[n].data = p; c[n].data > base && c[n].data[-1] != '/'; c[n].data--) { /* void */ }
+        c[n].len = p - c[n].data;
+    }
+    /* only segments are numbered, a directory of digits may hold a master playlist */
+    len = end - name;
+    if (n > 0 && c[0].len && c[0].len <= NGX_INT32_LEN
+            && ((len > 3 && ngx_strncmp(end - 3, ".ts", 3) == 0)
+            || (len > 4 && ngx_strncmp(end - 4, ".m4s", 4) == 0))) {
+        segment = ngx_atoi(c[0].data, c[0].len);
+        if (segment != NGX_ERROR) i++;
+    }
+    if (n > i && mp4_arg_is(c[i].data, c[i].len, "org")) {
+        options->org = 1;
+        i++;
+    } else if (n > i + 2 && mp4_arg_is(c[i].data, c[i].len, "hevc")
+            && mp4_arg_is(c[i + 2].data, c[i + 2].len, "adbr")) {
+        options->adbr = 1;
+        options->hevc = 1;
+        options->rendition = find_rendition(conf, (char const *) c[i + 1].data, c[i + 1].len);
+        i += 3;
+    } else if (n > i + 1 && mp4_arg_is(c[i + 1].data, c[i + 1].len, "adbr")) {
+        options->adbr = 1;
+        options->rendition = find_rendition(conf, (char const *) c[i].data, c[i].len);
+        i += 2;
+    } else if (n > i + 1 && mp4_arg_is(c[i + 1].data, c[i + 1].len, "org")) {
+        /* pre-encoded rung, see ngx_http_estreaming_variant.h */
+        options->org = 1;
+        options->rendition = find_rendition(conf, (char const *) c[i].data, c[i].len);
+        if (options->rendition == NULL) return NGX_DECLINED;
+        i += 2;
+    }
+    if (i == 0) return NGX_OK;
+    if (segment != NGX_ERROR) {
+        options->fragments = 1;
+        options->fragment_start = segment;
+    }
+    if (options->adbr && options->rendition == NULL && conf->renditions->nelts) {
+        options->rendition = conf->renditions->elts;
+    }
+    /* everything from the outermost component up to the name goes away */
+    p = c[i - 1].data;
+    uri->len = (p - base) + len;
+    uri->data = ngx_pnalloc(r->pool, uri->len);
+    if (uri->data == NULL) return NGX_ERROR;
+    ngx_memcpy(ngx_cpymem(uri->data, base, p - base), name, len);
+    return NGX_OK;
 }
 
 void mp4_split_options_exit(ngx_http_request_t *r, struct mp4_split_options_t *options) {
@@ -292,6 +390,226 @@ extern int mp4_split(struct mp4_context_t *mp4_context,
     return result;
 }
 
+/*
+ * coded size of the widest video track, from its visual sample entry (width
+ * and height at offset 24 after the box header) or else from tkhd
+ */
+static void moov_video_size(moov_t const *moov, int *width, int *height) {
+    trak_t const *trak;
+    sample_entry_t const *entry;
+    unsigned int track_id;
+    int w, h;
+
+    *width = 0;
+    *height = 0;
+    for (track_id = 0; track_id < moov->tracks_; ++track_id) {
+        trak = moov->traks_[track_id];
+        if (trak->mdia_->hdlr_->handler_type_ != FOURCC('v', 'i', 'd', 'e')) continue;
+        w = h = 0;
+        entry = trak->mdia_->minf_->stbl_->stsd_ && trak->mdia_->minf_->stbl_->stsd_->entries_ ?
+                trak->mdia_->minf_->stbl_->stsd_->sample_entries_ : NULL;
+        if (entry && entry->len_ >= 28) {
+            w = read_16(entry->buf_ + 24);
+            h = read_16(entry->buf_ + 26);
+        }
+        if ((w == 0 || h == 0) && trak->tkhd_) {
+            w = trak->tkhd_->width_ >> 16;
+            h = trak->tkhd_->height_ >> 16;
+        }
+        if (w > *width) {
+            *width = w;
+            *height = h;
+        }
+    }
+}
+
+/* duration in microseconds from mvhd, or the longest mdhd, -1 = unknown */
+static int64_t moov_duration(moov_t const *moov) {
+    trak_t const *trak;
+    unsigned int track_id;
+    int64_t duration = -1, d;
+
+    if (moov->mvhd_ && moov->mvhd_->timescale_ && moov->mvhd_->duration_)
+        return moov->mvhd_->duration_ * 1000000 / moov->mvhd_->timescale_;
+    for (track_id = 0; track_id < moov->tracks_; ++track_id) {
+        trak = moov->traks_[track_id];
+        if (!trak->mdia_->mdhd_->timescale_) continue;
+        d = trak->mdia_->mdhd_->duration_ * 1000000 / trak->mdia_->mdhd_->timescale_;
+        if (d > duration) duration = d;
+    }
+    return duration;
+}
+
+/*
+ * the segmentation shared by playlists, segments, prefetch and rate measures:
+ * a segment starts at a keyframe and ends at the keyframe, or the end of the
+ * track, whose distance to its start is nearest to length seconds. a cut only
+ * depends on where its segment starts, so a segment built alone from its
+ * number ends where its playlist says
+ */
+typedef struct {
+    samples_t *first; // keyframe the segment starts at
+    samples_t *last; // keyframe the next one starts at, or the end of the track
+    uint32_t start; // keyframe ordinal of first, the number in segment URLs
+    uint32_t next; // keyframe ordinal of last
+    uint64_t duration; // in the timescale of the track
+} moov_segment_t;
+
+/* segments are cut on the keyframes of the first video track */
+static trak_t *moov_segment_trak(moov_t const *moov) {
+    unsigned int track_id;
+
+    for (track_id = 0; track_id < moov->tracks_; ++track_id) {
+        if (moov->traks_[track_id]->mdia_->hdlr_->handler_type_ == FOURCC('v', 'i', 'd', 'e')
+                && moov->traks_[track_id]->samples_) return moov->traks_[track_id];
+    }
+    return NULL;
+}
+
+/* the sample n sync samples after first, the end of the track at most */
+static samples_t *moov_skip_keyframes(samples_t *first, samples_t *end, uint32_t n) {
+    while (first != end) {
+        ++first;
+        if (first->is_smooth_ss_ && --n == 0) break;
+    }
+    return first;
+}
+
+/*
+ * the segment following seg, or the first one when seg->last is NULL;
+ * 0 once the track is over. the sentinel sample after the last one is a
+ * sync sample at the end of the track, it closes the last segment
+ */
+static int moov_segment_next(trak_t const *trak, ngx_uint_t length, moov_segment_t *seg) {
+    samples_t *sample, *end = trak->samples_ + trak->samples_size_, *below = NULL;
+    uint64_t target = (uint64_t) length * trak->mdia_->mdhd_->timescale_, d, below_d = 0;
+    uint32_t i, below_i = 0;
+
+    if (seg->last == NULL) {
+        for (sample = trak->samples_; sample != end && !sample->is_smooth_ss_; ++sample) { /* void */ }
+        seg->first = sample;
+        seg->start = 0;
+    } else {
+        seg->first = seg->last;
+        seg->start = seg->next;
+    }
+    if (seg->first == end) return 0;
+    for (sample = seg->first + 1, i = seg->start + 1;; ++sample) {
+        if (!sample->is_smooth_ss_) continue;
+        d = sample->pts_ - seg->first->pts_;
+        if (d >= target || sample == end) break;
+        below = sample;
+        below_d = d;
+        below_i = i++;
+    }
+    if (below && d >= target && target - below_d < d - target) {
+        sample = below;
+        d = below_d;
+        i = below_i;
+    }
+    seg->last = sample;
+    seg->next = i;
+    seg->duration = d;
+    return 1;
+}
+
+/* the segment starting at keyframe ordinal start, 0 when there is none */
+static int moov_segment_at(trak_t const *trak, ngx_uint_t length, uint32_t start,
+        moov_segment_t *seg) {
+    samples_t *sample, *end = trak->samples_ + trak->samples_size_;
+    uint32_t i = 0;
+
+    for (sample = trak->samples_; sample != end; ++sample) {
+        if (!sample->is_smooth_ss_) continue;
+        if (i++ == start) break;
+    }
+    if (sample == end) return 0;
+    seg->last = sample;
+    seg->next = start;
+    return moov_segment_next(trak, length, seg);
+}
+
+/* seconds of the longest segment, rounded as EXT-X-TARGETDURATION wants it */
+static ngx_uint_t moov_target_duration(trak_t const *trak, uint64_t max) {
+    uint64_t timescale = trak->mdia_->mdhd_->timescale_;
+    ngx_uint_t target = (ngx_uint_t) ((max + timescale / 2) / timescale);
+    return target ? target : 1;
+}
+
+/*
+ * clipFrom/clipTo: the index is cut down to the keyframe aligned window
+ * mp4_split finds on the video track, before anything reads it. the other
+ * tracks are cut at the same times, where their sync marks are, and every
+ * track is rebased to start at 0, so playlists and segments only ever see
+ * the clip. NGX_DECLINED: the window holds no keyframe
+ */
+static ngx_int_t moov_clip(struct mp4_context_t *mp4_context, mp4_split_options_t const *options) {
+    moov_t *moov = mp4_context->moov;
+    mp4_split_options_t window;
+    trak_t *video, *trak;
+    samples_t *sample, *end, *limit;
+    unsigned int trak_sample_start[MAX_TRACKS], trak_sample_end[MAX_TRACKS];
+    unsigned int track_id, first = 0, last = 0;
+    uint64_t from, to, offset, stop;
+
+    if (options->clip_from == 0 && options->clip_to == 0) return NGX_OK;
+    if (options->clip_to && options->clip_to <= options->clip_from) return NGX_DECLINED;
+    if (!moov_build_index(mp4_context, moov)) return NGX_ERROR;
+    video = moov_segment_trak(moov);
+    if (video == NULL) return NGX_DECLINED;
+
+    window = *options;
+    window.start = (float) (options->clip_from / 1000.0);
+    window.end = (float) (options->clip_to / 1000.0);
+    if (!mp4_split(mp4_context, trak_sample_start, trak_sample_end, &window)) return NGX_DECLINED;
+    for (track_id = 0; track_id < moov->tracks_; ++track_id) {
+        if (moov->traks_[track_id] != video) continue;
+        first = trak_sample_start[track_id];
+        last = trak_sample_end[track_id];
+    }
+    if (last <= first || last > video->samples_size_) return NGX_DECLINED;
+    from = video->samples_[first].pts_;
+    to = video->samples_[last].pts_;
+
+    for (track_id = 0; track_id < moov->tracks_; ++track_id) {
+        trak = moov->traks_[track_id];
+        if (!trak->samples_) continue;
+        end = trak->samples_ + trak->samples_size_;
+        if (trak == video) {
+            sample = trak->samples_ + first;
+            end = trak->samples_ + last;
+            offset = from;
+        } else {
+            offset = trak_time_to_moov_time(from, trak->mdia_->mdhd_->timescale_,
+                    video->mdia_->mdhd_->timescale_);
+            stop = trak_time_to_moov_time(to, trak->mdia_->mdhd_->timescale_,
+                    video->mdia_->mdhd_->timescale_);
+            for (sample = trak->samples_; sample != end && sample->pts_ < offset; ++sample) { /* void */ }
+            if (last != video->samples_size_) {
+                limit = end;
+                for (end = sample; end != limit && end->pts_ < stop; ++end) { /* void */ }
+            }
+        }
+        /* the sample the window stops at is the sentinel of the clip */
+        trak->samples_size_ = (unsigned int) (end - sample);
+        ngx_memmove(trak->samples_, sample, (trak->samples_size_ + 1) * sizeof (samples_t));
+        for (sample = trak->samples_, end = sample + trak->samples_size_; sample <= end; ++sample) {
+            sample->pts_ -= offset;
+        }
+        end->is_smooth_ss_ = 1;
+        trak->mdia_->mdhd_->duration_ = end->pts_;
+        if (trak->tkhd_ && moov->mvhd_) {
+            trak->tkhd_->duration_ = trak_time_to_moov_time(end->pts_, moov->mvhd_->timescale_,
+                    trak->mdia_->mdhd_->timescale_);
+        }
+    }
+    if (moov->mvhd_) {
+        moov->mvhd_->duration_ = trak_time_to_moov_time(to - from, moov->mvhd_->timescale_,
+                video->mdia_->mdhd_->timescale_);
+    }
+    return NGX_OK;
+}
+
 uint64_t get_filesize(const char *path) {
     struct stat status;
     if (stat(path, &status)) {
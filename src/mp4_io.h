@@ -253,6 +253,7 @@ struct sample_entry_t {
     unsigned int samplerate_lo_;
 
     // esds
+    unsigned int object_type_id_;
     unsigned int max_bitrate_;
     unsigned int avg_bitrate_;
 };
@@ -1260,6 +1261,7 @@ static void sample_entry_init(sample_entry_t *sample_entry) {
   sample_entry->nBlockAlign = 0;
   sample_entry->wBitsPerSample = 16;
 
+  sample_entry->object_type_id_ = 0;
   sample_entry->max_bitrate_ = 0;
   sample_entry->avg_bitrate_ = 0;
 }
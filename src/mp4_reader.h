@@ -371,6 +371,7 @@ static int esds_read(mp4_context_t const *mp4_context,
   }
 
   object_type_id = read_8(buffer);
+  sample_entry->object_type_id_ = object_type_id;
   buffer += 1; // object_type_id
 
   stream_type = read_8(buffer);
@@ -0,0 +1,179 @@
+/*
+ * File:   ngx_http_adaptive_pool.h
+ * Author:  - Hung Nguyen
+ *
+ * Cache of opened decoder and encoder codec contexts, swscale scalers and
+ * swresample resamplers.
+ * Opening libx264 (lookahead threads, rate control), fdk-aac and initializing
+ * the scaler and resampler is a fixed cost we used to pay for every segment, so
+ * contexts are kept per thread (a worker is one thread unless transcoding is
+ * offloaded) and handed to the next segment with the same key.
+ * A released codec context is flushed, and the next segment starts its pts
+ * over. x264 only survives that without lookahead, B-frames or frame threads,
+ * so encoders are pooled only with tune=zerolatency left as it is, see
+ * ngx_estreaming_x264_low_delay.
+ */
+
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
+#include <libavutil/buffer.h>
+
+#define NGX_ESTREAMING_POOL_MAX 16
+/* AVFrame structs kept for reuse by each thread */
+#define NGX_ESTREAMING_FRAME_POOL 8
+
+#define ADAPTIVE_POOL_DECODER 1
+#define ADAPTIVE_POOL_ENCODER 2
+#define ADAPTIVE_POOL_SCALER  3
+#define ADAPTIVE_POOL_RESAMPLER 4
+
+typedef struct {
+    int kind;
+    enum AVCodecID codec_id;
+    int in_width;
+    int in_height;
+    int in_format; /* pix_fmt or sample_fmt */
+    int in_rate;
+    int in_channels;
+    AVRational time_base;
+    AVRational aspect;
+    int width;
+    int height;
+    int bit_rate;
+    int max_rate;
+    int preset;
+    int rate; /* resampler output */
+    int channels;
+    void const *rendition; /* encoder settings of the rung */
+    int low_delay; /* encoder without lookahead nor reordering, the only one pooled */
+    int single_thread; /* codec opened for a GOP job, no threads of its own */
+} adaptive_pool_key_t;
+
+typedef struct {
+    adaptive_pool_key_t key;
+    AVCodecContext *codec_ctx;
+    struct SwsContext *sws_ctx;
+    AVBufferPool *frame_pool;
+    SwrContext *swr_ctx;
+    ngx_msec_t last_used;
+    unsigned used : 1;
+    unsigned busy : 1;
+} adaptive_pool_entry_t;
+
+static __thread adaptive_pool_entry_t adaptive_pool[NGX_ESTREAMING_POOL_MAX];
+static __thread AVFrame *adaptive_frames[NGX_ESTREAMING_FRAME_POOL];
+static __thread ngx_uint_t adaptive_frames_n;
+
+/* the data of decoded frames already comes from the codec buffer pools */
+static AVFrame *adaptive_frame_get(void) {
+    if (adaptive_frames_n) return adaptive_frames[--adaptive_frames_n];
+    return av_frame_alloc();
+}
+
+static void adaptive_frame_put(AVFrame **frame) {
+    if (*frame == NULL) return;
+    av_frame_unref(*frame);
+    if (adaptive_frames_n < NGX_ESTREAMING_FRAME_POOL) {
+        adaptive_frames[adaptive_frames_n++] = *frame;
+        *frame = NULL;
+        return;
+    }
+    av_frame_free(frame);
+}
+
+static void adaptive_pool_key_init(adaptive_pool_key_t *key, int kind) {
+    /* keys are compared with ngx_memcmp, padding must be zeroed */
+    ngx_memzero(key, sizeof (adaptive_pool_key_t));
+    key->kind = kind;
+}
+
+static void adaptive_pool_entry_free(adaptive_pool_entry_t *entry) {
+    if (entry->codec_ctx) {
+        avcodec_close(entry->codec_ctx);
+        av_freep(&entry->codec_ctx);
+    }
+    if (entry->sws_ctx) {
+        sws_freeContext(entry->sws_ctx);
+    }
+    if (entry->frame_pool) {
+        av_buffer_pool_uninit(&entry->frame_pool);
+    }
+    if (entry->swr_ctx) {
+        swr_free(&entry->swr_ctx);
+    }
+    ngx_memzero(entry, sizeof (adaptive_pool_entry_t));
+}
+
+/* returns an idle entry with the same key, marked busy, or NULL */
+static adaptive_pool_entry_t *adaptive_pool_get(adaptive_pool_key_t const *key) {
+    ngx_uint_t i;
+    adaptive_pool_entry_t *entry;
+
+    for (i = 0; i < NGX_ESTREAMING_POOL_MAX; i++) {
+        entry = &adaptive_pool[i];
+        if (!entry->used || entry->busy) continue;
+        if (ngx_memcmp(&entry->key, key, sizeof (adaptive_pool_key_t)) != 0) continue;
+        entry->busy = 1;
+        entry->last_used = ngx_current_msec;
+        return entry;
+    }
+    return NULL;
+}
+
+/*
+ * reserves a slot for a newly opened context, evicting the least recently used
+ * idle entry when the first `size` slots are taken.
+ * returns NULL when pooling is disabled (size == 0) or everything is busy,
+ * in this case the caller owns its context and frees it itself.
+ */
+static adaptive_pool_entry_t *adaptive_pool_add(adaptive_pool_key_t const *key, ngx_uint_t size) {
+    ngx_uint_t i;
+    adaptive_pool_entry_t *entry, *lru = NULL;
+
+    if (size > NGX_ESTREAMING_POOL_MAX) size = NGX_ESTREAMING_POOL_MAX;
+
+    for (i = 0; i < size; i++) {
+        entry = &adaptive_pool[i];
+        if (!entry->used) {
+            lru = entry;
+            break;
+        }
+        if (entry->busy) continue;
+        if (lru == NULL || entry->last_used < lru->last_used) lru = entry;
+    }
+    if (lru == NULL) return NULL;
+    if (lru->used) {
+        av_log(NULL, AV_LOG_DEBUG, "evict pooled context kind:%d %dx%d\n",
+                lru->key.kind, lru->key.width, lru->key.height);
+        adaptive_pool_entry_free(lru);
+    }
+    lru->key = *key;
+    lru->used = 1;
+    lru->busy = 1;
+    lru->last_used = ngx_current_msec;
+    return lru;
+}
+
+/* hand the entry back; contexts which are in an unknown state are dropped */
+static void adaptive_pool_release(adaptive_pool_entry_t *entry, int reusable) {
+    if (entry == NULL) return;
+    if (!reusable) {
+        adaptive_pool_entry_free(entry);
+        return;
+    }
+    /* no frame of the last segment may be held over to the next one */
+    if (entry->codec_ctx) avcodec_flush_buffers(entry->codec_ctx);
+    entry->busy = 0;
+    entry->last_used = ngx_current_msec;
+}
+
+static void adaptive_pool_cleanup(void) {
+    ngx_uint_t i;
+    for (i = 0; i < NGX_ESTREAMING_POOL_MAX; i++) {
+        if (adaptive_pool[i].used) adaptive_pool_entry_free(&adaptive_pool[i]);
+    }
+    while (adaptive_frames_n) av_frame_free(&adaptive_frames[--adaptive_frames_n]);
+}
+
+// End Of File
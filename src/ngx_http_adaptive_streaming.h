@@ -15,22 +15,27 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
+#include <libavutil/audio_fifo.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/opt.h>
 #include <libavutil/old_pix_fmts.h>
-#include <libavfilter/avfiltergraph.h>
-#include <libavfilter/avcodec.h>
-#include <libavfilter/buffersink.h>
-#include <libavfilter/buffersrc.h>
+#include <libavutil/buffer.h>
 #include <libavutil/opt.h>
 #include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
 
 
 #define DIR_SEPARATOR '/'
 #define NGX_HTTP_STREAMING_MODULE_VIDEO_SEGMENT_NOT_FOUND 3
 #define NGX_HTTP_STREAMING_MODULE_STREAM_NOT_FOUND 4
 #define NGX_HTTP_STREAMING_MODULE_NO_DECODER 5
-#define NGX_STREAMING_CHUNK_MAX_SIZE 192200*2
+/* encoder output is kept in slabs of 174 ts packets, each one is sent when full */
+#define NGX_STREAMING_SLAB_SIZE (188 * 174)
+/* x264 never inserts a keyframe by itself, see open_video_encoder */
+#define NGX_STREAMING_GOP_INFINITE (1 << 30)
+/* frame + slice threads of one video decoder */
+#define NGX_ESTREAMING_DECODE_THREADS 4
 
 typedef struct {
     ngx_shm_zone_t *cache;
@@ -42,15 +47,52 @@ typedef struct {
 } adaptive_cache;
 
 typedef struct {
-    unsigned char *data;
+    unsigned char *data; // input side only
     int len;
     ngx_pool_t *pool;
+    /* encoded segment, one link per slab, the last one is being filled */
+    ngx_chain_t *first;
+    ngx_chain_t *tail;
+    ngx_chain_t *unsent; // first slab not passed to the output filter yet
+    /* when set the segment is sent while it is encoded, with chunked encoding */
+    ngx_http_request_t *r;
+    unsigned header_sent : 1;
+    unsigned error : 1;
+    unsigned fmp4 : 1; // video/mp4 instead of video/MP2T
+    unsigned skip : 1; // muxer output is dropped, see ngx_estreaming_adaptive_bitrate
 } video_buffer;
 
 typedef struct FilteringContext {
-    AVFilterContext *buffersink_ctx;
-    AVFilterContext *buffersrc_ctx;
-    AVFilterGraph *filter_graph;
+    struct SwsContext *sws_ctx;
+    AVBufferPool *frame_pool; // rendition sized pictures
+    /* letterbox of the source in the rendition, see scale_geometry */
+    int width;
+    int height;
+    int scaled_width;
+    int scaled_height;
+    int pad_x;
+    int pad_y;
+    int linesize[3];
+    /* opened codecs, owned by the context pool when the entry is set */
+    AVCodecContext *dec_ctx;
+    AVCodecContext *enc_ctx;
+    adaptive_pool_entry_t *dec_entry;
+    adaptive_pool_entry_t *enc_entry;
+    adaptive_pool_entry_t *scale_entry;
+    /* audio of renditions with their own audio settings */
+    SwrContext *swr_ctx;
+    adaptive_pool_entry_t *swr_entry;
+    AVAudioFifo *fifo; // resampled, waiting for a full encoder frame
+    int64_t next_pts; // in encoder time base
+
+    /* the next frame starts the segment: force an IDR */
+    int force_key;
+    /* GOP jobs: codecs run on the calling thread, the GOP pool is the parallelism */
+    int single_thread;
+    /* GOP jobs keep their encoded packets instead of muxing them */
+    AVPacket *packets;
+    int nb_packets;
+    int packets_size;
 } FilteringContext;
 
 uint64_t flatten_chain(ngx_chain_t *out, ngx_pool_t *pool, u_char **buf) {
@@ -94,14 +136,96 @@ static int read_packet(void *opaque, uint8_t *buf, int buf_size) {
     return buf_size;
 }
 
-static int open_input_file(ngx_pool_t *pool, ngx_chain_t *chain, int width,
-        int height, AVFormatContext *ifmt_ctx, AVIOContext **io_read_context) { /* Reserve height for future */
+/*
+ * a downscaled rendition hides most of what the H.264 loop filter and the
+ * non-reference frames add, the rendition decode mode trades them for speed.
+ * skip settings are read for every frame, so pooled decoders get them again.
+ */
+static void set_decode_mode(AVCodecContext *dec_ctx, AVCodecContext *codec_ctx,
+        ngx_http_estreaming_rendition_t const *rendition) {
+    dec_ctx->skip_loop_filter = AVDISCARD_DEFAULT;
+    dec_ctx->skip_frame = AVDISCARD_DEFAULT;
+    if (codec_ctx->codec_type != AVMEDIA_TYPE_VIDEO
+            || codec_ctx->width <= (int) rendition->width) return;
+    switch (rendition->decode) {
+        case NGX_ESTREAMING_DECODE_FASTEST:
+            /* drop the frames nothing refers to, halves B-frame heavy content */
+            dec_ctx->skip_loop_filter = AVDISCARD_ALL;
+            dec_ctx->skip_frame = AVDISCARD_NONREF;
+            break;
+        case NGX_ESTREAMING_DECODE_FAST:
+            /* nothing is predicted from these, so the skip does not drift */
+            dec_ctx->skip_loop_filter = AVDISCARD_NONREF;
+            break;
+    }
+}
+
+static int open_decoder(AVCodecContext *codec_ctx, ngx_http_estreaming_rendition_t const *rendition,
+        ngx_uint_t pool_size, FilteringContext *sctx) {
+    int ret;
+    AVCodec *decoder;
+    AVCodecContext *dec_ctx;
+    AVDictionary *vdec_opt = NULL;
+    adaptive_pool_key_t key;
+
+    adaptive_pool_key_init(&key, ADAPTIVE_POOL_DECODER);
+    key.codec_id = codec_ctx->codec_id;
+    key.in_width = codec_ctx->width;
+    key.in_height = codec_ctx->height;
+    key.in_format = codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO ?
+            codec_ctx->pix_fmt : codec_ctx->sample_fmt;
+    key.in_rate = codec_ctx->sample_rate;
+    key.in_channels = codec_ctx->channels;
+    key.single_thread = sctx->single_thread;
+
+    sctx->dec_entry = adaptive_pool_get(&key);
+    if (sctx->dec_entry) {
+        sctx->dec_ctx = sctx->dec_entry->codec_ctx;
+        avcodec_flush_buffers(sctx->dec_ctx);
+        set_decode_mode(sctx->dec_ctx, codec_ctx, rendition);
+        return 0;
+    }
+
+    decoder = avcodec_find_decoder(codec_ctx->codec_id);
+    if (!decoder) return AVERROR_DECODER_NOT_FOUND;
+    dec_ctx = avcodec_alloc_context3(decoder);
+    if (!dec_ctx) return AVERROR(ENOMEM);
+    if ((ret = avcodec_copy_context(dec_ctx, codec_ctx)) < 0) {
+        av_freep(&dec_ctx);
+        return ret;
+    }
+    dec_ctx->delay = 5;
+    dec_ctx->thread_count = 0;
+    if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+        av_dict_set(&vdec_opt, "vprofile", "baseline", 0);
+        /* auto would start one thread per core for every concurrent transcode */
+        dec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        dec_ctx->thread_count = sctx->single_thread ? 1
+                : ngx_min(ngx_ncpu, NGX_ESTREAMING_DECODE_THREADS);
+    }
+    set_decode_mode(dec_ctx, codec_ctx, rendition);
+    ret = avcodec_open2(dec_ctx, decoder, &vdec_opt);
+    av_dict_free(&vdec_opt);
+    if (ret < 0) {
+        avcodec_close(dec_ctx);
+        av_freep(&dec_ctx);
+        return ret;
+    }
+    sctx->dec_ctx = dec_ctx;
+    sctx->dec_entry = adaptive_pool_add(&key, pool_size);
+    if (sctx->dec_entry) sctx->dec_entry->codec_ctx = dec_ctx;
+    return 0;
+}
+
+static int open_input_file(ngx_pool_t *pool, ngx_chain_t *chain,
+        ngx_http_estreaming_rendition_t const *rendition, ngx_uint_t pool_size,
+        AVFormatContext *ifmt_ctx, AVIOContext **io_read_context,
+        FilteringContext **stream_ctx) {
     int ret;
     unsigned int i;
     /* move input format to local scope*/
     AVInputFormat *infmt;
     video_buffer *source;
-    AVDictionary *vdec_opt = NULL;
     unsigned char *exchange_area_read = NULL;
     u_char *buf = NULL;
     source = ngx_pcalloc(pool, sizeof (video_buffer));
@@ -126,42 +250,31 @@ static int open_input_file(ngx_pool_t *pool, ngx_chain_t *chain, int width,
         return ret;
     }
 
+    *stream_ctx = av_mallocz_array(ifmt_ctx->nb_streams, sizeof (FilteringContext));
+    if (*stream_ctx == NULL) return AVERROR(ENOMEM);
+
     int dec_ = 0;
     for (i = 0; i < ifmt_ctx->nb_streams; i++) {
-        AVStream *stream;
         AVCodecContext *codec_ctx;
-        stream = ifmt_ctx->streams[i];
-        codec_ctx = stream->codec;
-        codec_ctx->delay = 5;
-        codec_ctx->thread_count = 0;
+        codec_ctx = ifmt_ctx->streams[i]->codec;
         /* Reencode video & audio and remux subtitles etc. */
-        if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO
-                || codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
-            /* Open decoder */
-            if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-                av_dict_set(&vdec_opt, "vprofile", "baseline", 0);
-            }
-            ret = avcodec_open2(codec_ctx,
-                    avcodec_find_decoder(codec_ctx->codec_id), &vdec_opt);
-
-            if (ret < 0) {
-                av_log(NULL, AV_LOG_ERROR, "Failed to open decoder for stream #%u\n", i);
-                return ret;
-            }
-
-            if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && dec_ == 0) {
-                /* setting to test if it gains any performance hit*/
-                if (codec_ctx->codec->capabilities & CODEC_CAP_TRUNCATED)
-                    ifmt_ctx->video_codec->capabilities |= CODEC_CAP_TRUNCATED;
-                int video_width = codec_ctx->width;
-                av_log(NULL, AV_LOG_DEBUG, "source video w:%d, request w:%d\n", video_width, width);
-                if (video_width <= width) return -1;
-                dec_ = 1;
-            }
+        if (codec_ctx->codec_type != AVMEDIA_TYPE_VIDEO
+                && codec_ctx->codec_type != AVMEDIA_TYPE_AUDIO) {
+            continue;
+        }
+        if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && dec_ == 0) {
+            int video_width = codec_ctx->width;
+            av_log(NULL, AV_LOG_DEBUG, "source video w:%d, request w:%d\n", video_width,
+                    (int) rendition->width);
+            if (video_width <= (int) rendition->width) return -1;
+            dec_ = 1;
+        }
+        /* Open decoder */
+        ret = open_decoder(codec_ctx, rendition, pool_size, &(*stream_ctx)[i]);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Failed to open decoder for stream #%u\n", i);
+            return ret;
         }
-    }
-    if (vdec_opt) {
-        av_dict_free(&vdec_opt);
     }
     av_dump_format(ifmt_ctx, 0, "filename", 0);
     /*
@@ -173,38 +286,421 @@ static int open_input_file(ngx_pool_t *pool, ngx_chain_t *chain, int width,
     return 0;
 }
 
+/*
+ * the event loop is busy with the transcode, so a client closing its
+ * connection is only seen by peeking at the socket, like ngx_http_test_reading
+ */
+static ngx_int_t adaptive_client_gone(video_buffer *destination) {
+    ngx_connection_t *c;
+    ssize_t n;
+    char buf[1];
+
+    if (destination->error) return 1;
+    if (destination->r == NULL) return 0;
+    c = destination->r->connection;
+#if (NGX_HTTP_V2)
+    if (destination->r->stream) return 0;
+#endif
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+    if (n == 0 || (n == -1 && ngx_socket_errno != NGX_EAGAIN)) {
+        destination->error = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * pass the slabs encoded since the last call to the client, all of them when
+ * last is set, otherwise only the full ones. the response header goes out with
+ * the first bytes so that a transcode failing before any output can still be
+ * answered with the original segment
+ */
+static ngx_int_t write_adbr_flush(video_buffer *destination, int last) {
+    ngx_http_request_t *r = destination->r;
+    ngx_chain_t *cl, *out = NULL, **ll = &out;
+    ngx_buf_t *b = NULL;
+    ngx_int_t rc;
+
+    /* filters keep their own links, ours still chain the whole segment */
+    for (cl = destination->unsent; cl && (cl != destination->tail || last); cl = cl->next) {
+        *ll = ngx_alloc_chain_link(destination->pool);
+        if (*ll == NULL) {
+            destination->error = 1;
+            return NGX_ERROR;
+        }
+        b = cl->buf;
+        (*ll)->buf = b;
+        ll = &(*ll)->next;
+    }
+    *ll = NULL;
+    if (out == NULL) return NGX_OK;
+    destination->unsent = cl;
+
+    if (!destination->header_sent) {
+        destination->header_sent = 1;
+        r->headers_out.status = NGX_HTTP_OK;
+        r->headers_out.content_length_n = last ? destination->len : -1;
+        if (destination->fmp4) {
+            ngx_str_set(&r->headers_out.content_type, "video/mp4");
+        } else {
+            ngx_str_set(&r->headers_out.content_type, "video/MP2T");
+        }
+        r->allow_ranges = 0;
+        rc = ngx_http_send_header(r);
+        if (rc == NGX_ERROR || rc > NGX_OK) {
+            destination->error = 1;
+            return NGX_ERROR;
+        }
+    }
+    if (r->header_only) return NGX_OK;
+    b->flush = 1;
+    b->last_buf = last;
+    rc = ngx_http_output_filter(r, out);
+    if (rc == NGX_ERROR) destination->error = 1;
+    return rc;
+}
+
+/* avio write callback, appends to the slab chain growing it as needed */
 static int write_adbr_packet(void *opaque, unsigned char *buf, int buf_size) {
-    int old_size;
     video_buffer *destination = (video_buffer *) opaque;
+    ngx_chain_t *cl;
+    int n, size = buf_size;
 
-    if (destination->data == NULL) {
-        destination->data = ngx_pcalloc(destination->pool, NGX_STREAMING_CHUNK_MAX_SIZE * sizeof (*destination));
+    if (destination->skip) return buf_size;
+    while (size) {
+        cl = destination->tail;
+        if (cl == NULL || cl->buf->last == cl->buf->end) {
+            cl = ngx_alloc_chain_link(destination->pool);
+            if (cl == NULL) return AVERROR(ENOMEM);
+            cl->buf = ngx_create_temp_buf(destination->pool, NGX_STREAMING_SLAB_SIZE);
+            if (cl->buf == NULL) return AVERROR(ENOMEM);
+            cl->next = NULL;
+            if (destination->tail) {
+                destination->tail->next = cl;
+            } else {
+                destination->first = cl;
+            }
+            if (destination->unsent == NULL) destination->unsent = cl;
+            destination->tail = cl;
+            /* the previous slab is complete now */
+            if (destination->r && write_adbr_flush(destination, 0) == NGX_ERROR) {
+                return AVERROR(EIO);
+            }
+        }
+        n = ngx_min(size, cl->buf->end - cl->buf->last);
+        cl->buf->last = ngx_cpymem(cl->buf->last, buf, n);
+        buf += n;
+        size -= n;
+        destination->len += n;
     }
-    old_size = destination->len;
-    destination->len += buf_size;
-    ngx_memmove(destination->data + old_size, buf, buf_size * sizeof (unsigned char));
     return buf_size;
 }
 
+/*
+ * libx265 for the HEVC variant of a rung. not pooled: like fdk-aac, x265 takes
+ * no frames anymore once it was flushed. GOPs are closed, so the frames forced
+ * to I at source keyframes are IDRs.
+ */
+static int open_hevc_encoder(AVCodecContext *dec_ctx, ngx_http_estreaming_rendition_t *rendition,
+        ngx_estreaming_rung_t const *rate, int global_header, FilteringContext *sctx) {
+    int ret;
+    AVCodec *encoder;
+    AVCodecContext *enc_ctx;
+    AVDictionary *option = NULL;
+    ngx_str_t const *preset;
+    ngx_uint_t level;
+    u_char value[256], *p;
+
+    encoder = avcodec_find_encoder_by_name("libx265");
+    if (!encoder) {
+        av_log(NULL, AV_LOG_ERROR, "libx265 encoder not found\n");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    enc_ctx = avcodec_alloc_context3(encoder);
+    if (!enc_ctx) return AVERROR(ENOMEM);
+    enc_ctx->width = rendition->width;
+    enc_ctx->height = rendition->height;
+    enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+    enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    /* x265 takes its frame rate from there, timestamps pass through untouched */
+    enc_ctx->time_base = dec_ctx->time_base.num ? dec_ctx->time_base : (AVRational) {1, 24};
+    enc_ctx->ticks_per_frame = dec_ctx->ticks_per_frame;
+    enc_ctx->bit_rate = rate->bitrate;
+    if (global_header)
+        enc_ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+    level = ngx_estreaming_hevc_level(rendition->width, rendition->height);
+    p = ngx_snprintf(value, sizeof (value) - 1,
+            "keyint=-1:min-keyint=1:open-gop=0:scenecut=0:bframes=0:level-idc=%ui.%ui",
+            level / 30, level % 30 / 3);
+    if (rate->maxrate) {
+        p = ngx_snprintf(p, value + sizeof (value) - 1 - p, ":vbv-maxrate=%ui:vbv-bufsize=%ui",
+                rate->maxrate / 1000, rate->bufsize / 1000);
+    }
+    if (sctx->single_thread) {
+        p = ngx_snprintf(p, value + sizeof (value) - 1 - p, ":pools=none:frame-threads=1");
+    }
+    *p = '\0';
+    av_dict_set(&option, "x265-params", (char *) value, 0);
+    /* x265 has the x264 preset names */
+    preset = rate->preset >= 0 ? &ngx_estreaming_preset_names[rate->preset] : &rendition->preset;
+    ngx_cpystrn(value, preset->data, ngx_min(preset->len + 1, sizeof (value)));
+    av_dict_set(&option, "preset", (char *) value, 0);
+    av_dict_set(&option, "tune", "zerolatency", 0);
+    ret = avcodec_open2(enc_ctx, encoder, &option);
+    av_dict_free(&option);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open hevc encoder\n");
+        avcodec_close(enc_ctx);
+        av_freep(&enc_ctx);
+        return ret;
+    }
+    sctx->enc_ctx = enc_ctx;
+    return 0;
+}
+
+/*
+ * x264opts which bring back what tune=zerolatency turns off: lookahead,
+ * B-frames and frame threads. such an encoder holds frames across a flush
+ * and is never pooled. the baseline profile is applied after x264opts and
+ * turns B-frames off again
+ */
+static ngx_uint_t ngx_estreaming_x264_low_delay(ngx_http_estreaming_rendition_t const *rendition) {
+    static ngx_str_t const delay[] = {
+        ngx_string("rc-lookahead"), ngx_string("sync-lookahead"), ngx_string("sliced-threads"),
+        ngx_string("tune"), ngx_string("bframes"), ngx_string("b-adapt")
+    };
+    ngx_str_t const *x264opts = &rendition->x264opts;
+    u_char *p = x264opts->data, *last = p + x264opts->len, *end, *eq;
+    ngx_uint_t i, n = sizeof (delay) / sizeof (delay[0]);
+
+    if (rendition->profile.len == sizeof ("baseline") - 1
+            && ngx_strncmp(rendition->profile.data, "baseline", sizeof ("baseline") - 1) == 0) {
+        n -= 2;
+    }
+
+    for (; p < last; p = end + 1) {
+        end = ngx_strlchr(p, last, ':');
+        if (end == NULL) end = last;
+        eq = ngx_strlchr(p, end, '=');
+        if (eq == NULL) eq = end;
+        for (i = 0; i < n; i++) {
+            if ((size_t) (eq - p) == delay[i].len && ngx_strncmp(p, delay[i].data, delay[i].len) == 0)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static int open_video_encoder(AVCodecContext *dec_ctx, ngx_http_estreaming_rendition_t *rendition,
+        ngx_estreaming_rung_t const *rate, int global_header, ngx_uint_t pool_size,
+        FilteringContext *sctx) {
+    int ret;
+    AVCodec *encoder;
+    AVCodecContext *enc_ctx;
+    AVDictionary *option = NULL;
+    adaptive_pool_key_t key;
+    ngx_str_t const *preset;
+    char value[128];
+
+    adaptive_pool_key_init(&key, ADAPTIVE_POOL_ENCODER);
+    key.codec_id = dec_ctx->codec_id;
+    key.in_width = dec_ctx->width;
+    key.in_height = dec_ctx->height;
+    key.aspect = dec_ctx->sample_aspect_ratio;
+    key.width = rendition->width;
+    key.height = rendition->height;
+    key.bit_rate = rate->bitrate ? rate->bitrate : rendition->bitrate;
+    key.max_rate = rate->maxrate;
+    key.preset = rate->preset;
+    key.rendition = rendition;
+    key.low_delay = ngx_estreaming_x264_low_delay(rendition);
+    key.single_thread = sctx->single_thread;
+    if (!key.low_delay) pool_size = 0;
+
+    sctx->force_key = 1;
+    if (rate->hevc)
+        return open_hevc_encoder(dec_ctx, rendition, rate, global_header, sctx);
+    sctx->enc_entry = key.low_delay ? adaptive_pool_get(&key) : NULL;
+    if (sctx->enc_entry) {
+        sctx->enc_ctx = sctx->enc_entry->codec_ctx;
+        return 0;
+    }
+
+    encoder = avcodec_find_encoder(dec_ctx->codec_id);
+    if (!encoder) {
+        av_log(NULL, AV_LOG_ERROR, "Necessary encoder not found\n");
+        return AVERROR_INVALIDDATA;
+    }
+    enc_ctx = avcodec_alloc_context3(encoder);
+    if (!enc_ctx) return AVERROR(ENOMEM);
+    enc_ctx->width = rendition->width;
+    enc_ctx->height = rendition->height;
+    enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+    enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc_ctx->has_b_frames = dec_ctx->has_b_frames;
+    enc_ctx->skip_frame = AVDISCARD_NONE;
+    enc_ctx->bit_rate = key.bit_rate;
+    enc_ctx->qmin = rendition->qmin;
+    enc_ctx->qmax = rendition->qmax;
+    enc_ctx->bit_rate_tolerance = 0;
+    enc_ctx->rc_max_rate = rate->maxrate;
+    enc_ctx->rc_buffer_size = rate->bufsize;
+    /*
+     * no periodic keyframes: IDRs are forced at the segment start and where
+     * the source has a keyframe, so every rendition shares the org GOP table
+     * and any segment can be encoded on its own
+     */
+    enc_ctx->gop_size = NGX_STREAMING_GOP_INFINITE;
+    enc_ctx->keyint_min = 1;
+    enc_ctx->max_b_frames = 0;
+    enc_ctx->b_frame_strategy = 1;
+    enc_ctx->coder_type = 0;
+    enc_ctx->me_cmp = 1;
+    enc_ctx->me_range = 16;
+    enc_ctx->scenechange_threshold = 0;
+    //            if ((LIBAVCODEC_VERSION_MAJOR <= 56) || !(LIBAVCODEC_VERSION_MINOR <= 8)) {
+    //                enc_ctx->me_method = ME_ITER;
+    //            }
+    enc_ctx->me_subpel_quality = 4;
+    enc_ctx->i_quant_factor = 1;
+    enc_ctx->qcompress = 0;
+    enc_ctx->max_qdiff = 4;
+    // license features
+    enc_ctx->thread_count = sctx->single_thread ? 1 : 0;
+    enc_ctx->flags |= CODEC_FLAG_LOOP_FILTER;
+    enc_ctx->flags |= CODEC_FLAG_CLOSED_GOP;
+    if (global_header)
+        enc_ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    if (av_dict_set(&option, "vsync", "0", 0) < 0)
+        av_log(NULL, AV_LOG_ERROR, "cannot set vsync option\n");
+    if (av_dict_set(&option, "mpegts_copyts", "1", 0) < 0)
+        av_log(NULL, AV_LOG_ERROR, "cannot set mpegts_copyts option\n");
+    if (rendition->x264opts.len) {
+        ngx_cpystrn((u_char *) value, rendition->x264opts.data,
+                ngx_min(rendition->x264opts.len + 1, sizeof (value)));
+        av_dict_set(&option, "x264opts", value, 0);
+    }
+    preset = rate->preset >= 0 ? &ngx_estreaming_preset_names[rate->preset] : &rendition->preset;
+    ngx_cpystrn((u_char *) value, preset->data, ngx_min(preset->len + 1, sizeof (value)));
+    av_dict_set(&option, "preset", value, 0);
+    av_dict_set(&option, "r", "24", 0);
+    ngx_cpystrn((u_char *) value, rendition->profile.data,
+            ngx_min(rendition->profile.len + 1, sizeof (value)));
+    av_dict_set(&option, "vprofile", value, 0);
+    ngx_cpystrn((u_char *) value, rendition->level.data,
+            ngx_min(rendition->level.len + 1, sizeof (value)));
+    av_dict_set(&option, "level", value, 0);
+    /* required by the pool, see ngx_estreaming_x264_low_delay */
+    av_dict_set(&option, "tune", "zerolatency", 0);
+    av_dict_set(&option, "forced-idr", "1", 0);
+    ret = avcodec_open2(enc_ctx, encoder, &option);
+    av_dict_free(&option);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open video encoder\n");
+        avcodec_close(enc_ctx);
+        av_freep(&enc_ctx);
+        return ret;
+    }
+    sctx->enc_ctx = enc_ctx;
+    sctx->enc_entry = adaptive_pool_add(&key, pool_size);
+    if (sctx->enc_entry) sctx->enc_entry->codec_ctx = enc_ctx;
+    return 0;
+}
+
+/*
+ * fdk-aac with the audio settings of the rendition, HE-AAC for low bitrates.
+ * not pooled: fdk-aac does not take samples anymore once it was flushed
+ */
+static int open_audio_encoder(AVCodecContext *dec_ctx, ngx_http_estreaming_rendition_t *rendition,
+        int global_header, FilteringContext *sctx) {
+    int ret;
+    AVCodec *encoder;
+    AVCodecContext *enc_ctx;
+
+    encoder = avcodec_find_encoder_by_name("libfdk_aac");
+    if (!encoder) {
+        av_log(NULL, AV_LOG_ERROR, "libfdk_aac encoder not found\n");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    enc_ctx = avcodec_alloc_context3(encoder);
+    if (!enc_ctx) return AVERROR(ENOMEM);
+    enc_ctx->sample_fmt = AV_SAMPLE_FMT_S16;
+    enc_ctx->sample_rate = rendition->audio_rate ? (int) rendition->audio_rate : dec_ctx->sample_rate;
+    enc_ctx->channels = rendition->audio_channels;
+    enc_ctx->channel_layout = av_get_default_channel_layout(enc_ctx->channels);
+    enc_ctx->bit_rate = rendition->audio_bitrate;
+    enc_ctx->time_base = (AVRational) {1, enc_ctx->sample_rate};
+    if (rendition->audio_bitrate <= NGX_ESTREAMING_HE_AAC_MAX)
+        enc_ctx->profile = FF_PROFILE_AAC_HE;
+    if (global_header)
+        enc_ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    ret = avcodec_open2(enc_ctx, encoder, NULL);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open audio encoder\n");
+        avcodec_close(enc_ctx);
+        av_freep(&enc_ctx);
+        return ret;
+    }
+    sctx->enc_ctx = enc_ctx;
+    return 0;
+}
+
+/* converts decoded samples to the format, layout and rate of the encoder */
+static int open_resampler(ngx_uint_t pool_size, FilteringContext *sctx) {
+    AVCodecContext *dec_ctx = sctx->dec_ctx;
+    AVCodecContext *enc_ctx = sctx->enc_ctx;
+    adaptive_pool_key_t key;
+    int64_t layout;
+    int ret;
+
+    sctx->next_pts = AV_NOPTS_VALUE;
+    sctx->fifo = av_audio_fifo_alloc(enc_ctx->sample_fmt, enc_ctx->channels, enc_ctx->frame_size);
+    if (sctx->fifo == NULL) return AVERROR(ENOMEM);
+
+    adaptive_pool_key_init(&key, ADAPTIVE_POOL_RESAMPLER);
+    key.in_format = dec_ctx->sample_fmt;
+    key.in_rate = dec_ctx->sample_rate;
+    key.in_channels = dec_ctx->channels;
+    key.rate = enc_ctx->sample_rate;
+    key.channels = enc_ctx->channels;
+    sctx->swr_entry = adaptive_pool_get(&key);
+    if (sctx->swr_entry) {
+        sctx->swr_ctx = sctx->swr_entry->swr_ctx;
+        return 0;
+    }
+    layout = dec_ctx->channel_layout ? (int64_t) dec_ctx->channel_layout
+            : av_get_default_channel_layout(dec_ctx->channels);
+    sctx->swr_ctx = swr_alloc_set_opts(NULL, enc_ctx->channel_layout, enc_ctx->sample_fmt,
+            enc_ctx->sample_rate, layout, dec_ctx->sample_fmt, dec_ctx->sample_rate, 0, NULL);
+    if (sctx->swr_ctx == NULL) return AVERROR(ENOMEM);
+    if ((ret = swr_init(sctx->swr_ctx)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot initialize the resampler\n");
+        return ret;
+    }
+    sctx->swr_entry = adaptive_pool_add(&key, pool_size);
+    if (sctx->swr_entry) sctx->swr_entry->swr_ctx = sctx->swr_ctx;
+    return 0;
+}
+
 static int prepare_output_encoder(ngx_http_request_t *req, video_buffer *destination,
-        AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx, int width, int height,
-        AVIOContext **io_context) {
+        AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx,
+        ngx_http_estreaming_rendition_t *rendition, ngx_estreaming_rung_t const *rate,
+        ngx_uint_t pool_size, FilteringContext *stream_ctx, AVIOContext **io_context) {
     AVStream *out_stream;
     AVStream *in_stream;
-    AVCodecContext *dec_ctx, *enc_ctx;
-    AVCodec *encoder;
+    AVCodecContext *dec_ctx;
     //    AVIOContext *io_context;
     int ret;
     unsigned int i;
     int buffer_size;
-    AVDictionary *option = NULL;
     AVDictionary *format_option = NULL;
     unsigned char *exchange_area_write;
     buffer_size = 1024;
     exchange_area_write = (unsigned char *) av_mallocz(buffer_size * sizeof (unsigned char));
     *io_context = avio_alloc_context(exchange_area_write, buffer_size, 1, (void *) destination, NULL, write_adbr_packet, NULL);
     ofmt_ctx->pb = *io_context;
-    ofmt_ctx->oformat = av_guess_format("mpegts", NULL, NULL);
+    ofmt_ctx->oformat = av_guess_format(rate->hevc ? "mp4" : "mpegts", NULL, NULL);
     if (!ofmt_ctx) {
         av_log(NULL, AV_LOG_ERROR, "Could not create output context\n");
         return AVERROR_UNKNOWN;
@@ -222,67 +718,40 @@ static int prepare_output_encoder(ngx_http_request_t *req, video_buffer *destina
         }
         in_stream = ifmt_ctx->streams[i];
         dec_ctx = in_stream->codec;
-        enc_ctx = out_stream->codec;
         out_stream->duration = in_stream->duration;
         out_stream->metadata = in_stream->metadata;
         out_stream->start_time = in_stream->start_time;
         if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-            encoder = avcodec_find_encoder(dec_ctx->codec_id);
-            enc_ctx->width = width;
-            enc_ctx->height = height;
             out_stream->avg_frame_rate = in_stream->avg_frame_rate;
             out_stream->r_frame_rate = in_stream->r_frame_rate;
-            enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
-            enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
             out_stream->time_base = in_stream->time_base;
-            enc_ctx->has_b_frames = dec_ctx->has_b_frames;
-            enc_ctx->frame_number = dec_ctx->frame_number;
-            enc_ctx->skip_frame = AVDISCARD_NONE;
-            if (width == 640) {
-                enc_ctx->bit_rate = 1000 * 1000;
-                enc_ctx->qmin = 30;
-                enc_ctx->qmax = 100;
-            } else if (width == 854) {
-                enc_ctx->bit_rate = 2000 * 1000;
-                enc_ctx->qmin = 25;
-                enc_ctx->qmax = 90;
-            } else {
-                enc_ctx->bit_rate = 3000 * 1000;
-                enc_ctx->qmin = 20;
-                enc_ctx->qmax = 80;
+            ret = open_video_encoder(stream_ctx[i].dec_ctx, rendition, rate,
+                    ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER, pool_size, &stream_ctx[i]);
+            if (ret < 0)
+                return ret;
+            /* the muxer only needs the parameters, the pooled context encodes */
+            ret = avcodec_copy_context(out_stream->codec, stream_ctx[i].enc_ctx);
+            if (ret < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Copying encoder context failed\n");
+                return ret;
             }
-            enc_ctx->bit_rate_tolerance = 0;
-            enc_ctx->rc_max_rate = 0;
-            enc_ctx->rc_buffer_size = 0;
-            enc_ctx->gop_size = 25;
-            enc_ctx->keyint_min = 50;
-            enc_ctx->max_b_frames = 0;
-            enc_ctx->b_frame_strategy = 1;
-            enc_ctx->coder_type = 0;
-            enc_ctx->me_cmp = 1;
-            enc_ctx->me_range = 16;
-            enc_ctx->scenechange_threshold = 0;
-            //            if ((LIBAVCODEC_VERSION_MAJOR <= 56) || !(LIBAVCODEC_VERSION_MINOR <= 8)) {
-            //                enc_ctx->me_method = ME_ITER;
-            //            }
-            enc_ctx->me_subpel_quality = 4;
-            enc_ctx->i_quant_factor = 1;
-            enc_ctx->qcompress = 0;
-            enc_ctx->max_qdiff = 4;
-            // license features
-            enc_ctx->thread_count = 0;
-            enc_ctx->flags |= CODEC_FLAG_LOOP_FILTER;
-            if (av_dict_set(&option, "vsync", "0", 0) < 0)
-                av_log(NULL, AV_LOG_ERROR, "cannot set vsync option\n");
-            if (av_dict_set(&option, "mpegts_copyts", "1", 0) < 0)
-                av_log(NULL, AV_LOG_ERROR, "cannot set mpegts_copyts option\n");
-            av_dict_set(&option, "x264opts", "bframes=16:keyint=50:min-keyint=50:no-scenecut", 0);
-            av_dict_set(&option, "preset", "medium", 0);
-            av_dict_set(&option, "r", "24", 0);
-            av_dict_set(&option, "vprofile", "baseline", 0);
-            av_dict_set(&option, "level", "3.0", 0);
-            av_dict_set(&option, "tune", "zerolatency", 0);
-            avcodec_open2(enc_ctx, encoder, &option);
+            /* Apple players only take HEVC with the parameter sets in the sample entry */
+            if (rate->hevc)
+                out_stream->codec->codec_tag = MKTAG('h', 'v', 'c', '1');
+        } else if (dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO && rendition->audio_bitrate
+                && stream_ctx[i].dec_ctx) {
+            ret = open_audio_encoder(stream_ctx[i].dec_ctx, rendition,
+                    ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER, &stream_ctx[i]);
+            if (ret < 0)
+                return ret;
+            if ((ret = open_resampler(pool_size, &stream_ctx[i])) < 0)
+                return ret;
+            ret = avcodec_copy_context(out_stream->codec, stream_ctx[i].enc_ctx);
+            if (ret < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Copying encoder context failed\n");
+                return ret;
+            }
+            out_stream->time_base = stream_ctx[i].enc_ctx->time_base;
         } else if (dec_ctx->codec_type == AVMEDIA_TYPE_UNKNOWN) {
             av_log(NULL, AV_LOG_FATAL, "Elementary stream #%d is of unknown type, cannot proceed\n", i);
             return AVERROR_INVALIDDATA;
@@ -295,16 +764,18 @@ static int prepare_output_encoder(ngx_http_request_t *req, video_buffer *destina
                 return ret;
             }
         }
-        if (ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
-            enc_ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
     }
     /* init muxer, write output file header */
     av_dict_set(&format_option, "mpegts_copyts", "1", 0);
     av_dict_set(&format_option, "copy_ts", "1", 0);
     av_dict_set(&format_option, "vsync", "0", 0);
+    if (rate->hevc) {
+        /* a moof per source GOP, decode times kept from the source segment */
+        av_dict_set(&format_option, "movflags",
+                "frag_keyframe+empty_moov+default_base_moof+frag_discont", 0);
+    }
     ret = avformat_write_header(ofmt_ctx, &format_option);
     av_dict_free(&format_option);
-    av_dict_free(&option);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Error occurred when opening output file\n");
         return ret;
@@ -313,202 +784,155 @@ static int prepare_output_encoder(ngx_http_request_t *req, video_buffer *destina
     return 0;
 }
 
-static int init_filter(FilteringContext* fctx, AVCodecContext *dec_ctx,
-        AVCodecContext *enc_ctx, const char *filter_spec) {
-    char args[512];
-    int ret = 0;
-    AVFilter *buffersrc = NULL;
-    AVFilter *buffersink = NULL;
-    AVFilterContext *buffersrc_ctx = NULL;
-    AVFilterContext *buffersink_ctx = NULL;
-    AVFilterInOut *outputs = avfilter_inout_alloc();
-    AVFilterInOut *inputs = avfilter_inout_alloc();
-    AVFilterGraph *filter_graph = avfilter_graph_alloc();
-
-    av_log(NULL, AV_LOG_DEBUG, "Filter frame\n");
-    if (!outputs || !inputs || !filter_graph) {
-        ret = AVERROR(ENOMEM);
-        goto end;
-    }
-
-    if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-        buffersrc = avfilter_get_by_name("buffer");
-        buffersink = avfilter_get_by_name("buffersink");
-        if (!buffersrc || !buffersink) {
-            av_log(NULL, AV_LOG_ERROR, "filtering source or sink element not found\n");
-            ret = AVERROR_UNKNOWN;
-            goto end;
-        }
-        snprintf(args, sizeof (args),
-                "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-                //                dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
-                dec_ctx->width, dec_ctx->height, AV_PIX_FMT_YUV420P,
-                dec_ctx->time_base.num, dec_ctx->time_base.den,
-                dec_ctx->sample_aspect_ratio.num,
-                dec_ctx->sample_aspect_ratio.den);
-
-        ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in",
-                args, NULL, filter_graph);
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot create buffer source\n");
-            goto end;
-        }
-        ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out",
-                NULL, NULL, filter_graph);
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot create buffer sink\n");
-            goto end;
-        }
-
-        ret = av_opt_set_bin(buffersink_ctx, "pix_fmts",
-                (uint8_t*) & enc_ctx->pix_fmt, sizeof (enc_ctx->pix_fmt),
-                AV_OPT_SEARCH_CHILDREN);
-
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot set output pixel format\n");
-            goto end;
-        }
-
-    } else if (dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
-        buffersrc = avfilter_get_by_name("abuffer");
-        buffersink = avfilter_get_by_name("abuffersink");
-        if (!buffersrc || !buffersink) {
-            av_log(NULL, AV_LOG_ERROR, "filtering source or sink element not found\n");
-            ret = AVERROR_UNKNOWN;
-            goto end;
-        }
-
-        if (!dec_ctx->channel_layout)
-            dec_ctx->channel_layout =
-                av_get_default_channel_layout(dec_ctx->channels);
-        snprintf(args, sizeof (args),
-                "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64,
-                dec_ctx->time_base.num, dec_ctx->time_base.den, dec_ctx->sample_rate,
-                av_get_sample_fmt_name(dec_ctx->sample_fmt),
-                dec_ctx->channel_layout);
-        ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in",
-                args, NULL, filter_graph);
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot create audio buffer source\n");
-            goto end;
-        }
-
-        ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out",
-                NULL, NULL, filter_graph);
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot create audio buffer sink\n");
-            goto end;
-        }
-
-        ret = av_opt_set_bin(buffersink_ctx, "sample_fmts",
-                (uint8_t*) & enc_ctx->sample_fmt, sizeof (enc_ctx->sample_fmt),
-                AV_OPT_SEARCH_CHILDREN);
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot set output sample format\n");
-            goto end;
-        }
-
-        ret = av_opt_set_bin(buffersink_ctx, "channel_layouts",
-                (uint8_t*) & enc_ctx->channel_layout,
-                sizeof (enc_ctx->channel_layout), AV_OPT_SEARCH_CHILDREN);
-
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot set output channel layout\n");
-            goto end;
-        }
-
-        ret = av_opt_set_bin(buffersink_ctx, "sample_rates",
-                (uint8_t*) & enc_ctx->sample_rate, sizeof (enc_ctx->sample_rate),
-                AV_OPT_SEARCH_CHILDREN);
-
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Cannot set output sample rate\n");
-            goto end;
-        }
-
+/*
+ * letterbox geometry of the source inside the rendition: the picture keeps its
+ * proportions and is centered, columns on a 16 pixel boundary so that every
+ * destination row swscale writes stays aligned for its SIMD paths
+ */
+static void scale_geometry(FilteringContext *fctx, int in_width, int in_height,
+        int width, int height) {
+    fctx->width = width;
+    fctx->height = height;
+    if ((int64_t) in_width * height <= (int64_t) in_height * width) {
+        fctx->scaled_height = height;
+        fctx->scaled_width = ((int64_t) in_width * height / in_height) & ~1;
     } else {
-        ret = AVERROR_UNKNOWN;
-        goto end;
+        fctx->scaled_width = width;
+        fctx->scaled_height = ((int64_t) in_height * width / in_width) & ~1;
     }
+    fctx->pad_x = ((width - fctx->scaled_width) / 2) & ~15;
+    fctx->pad_y = ((height - fctx->scaled_height) / 2) & ~1;
+    fctx->linesize[0] = FFALIGN(width, 32);
+    fctx->linesize[1] = FFALIGN(width / 2, 32);
+    fctx->linesize[2] = fctx->linesize[1];
+}
 
-    /* Endpoints for the filter graph. */
-    outputs->name = av_strdup("in");
-    outputs->filter_ctx = buffersrc_ctx;
-    outputs->pad_idx = 0;
-    outputs->next = NULL;
-
-    inputs->name = av_strdup("out");
-    inputs->filter_ctx = buffersink_ctx;
-    inputs->pad_idx = 0;
-    inputs->next = NULL;
+/* scale one decoded video stream to the rendition size, into pooled pictures */
+static int init_video_scaler(int width, int height, ngx_uint_t pool_size,
+        FilteringContext *fctx) {
+    AVCodecContext *dec_ctx = fctx->dec_ctx;
+    adaptive_pool_key_t key;
 
-    if (!outputs->name || !inputs->name) {
-        ret = AVERROR(ENOMEM);
-        goto end;
+    scale_geometry(fctx, dec_ctx->width, dec_ctx->height, width, height);
+    adaptive_pool_key_init(&key, ADAPTIVE_POOL_SCALER);
+    key.in_width = dec_ctx->width;
+    key.in_height = dec_ctx->height;
+    key.in_format = dec_ctx->pix_fmt;
+    key.width = width;
+    key.height = height;
+    fctx->scale_entry = adaptive_pool_get(&key);
+    if (fctx->scale_entry) {
+        fctx->sws_ctx = fctx->scale_entry->sws_ctx;
+        fctx->frame_pool = fctx->scale_entry->frame_pool;
+        return 0;
     }
-
-    if ((ret = avfilter_graph_parse_ptr(filter_graph, filter_spec,
-            &inputs, &outputs, NULL)) < 0)
-        goto end;
-
-    if ((ret = avfilter_graph_config(filter_graph, NULL)) < 0)
-        goto end;
-
-    /* Fill FilteringContext */
-    fctx->buffersrc_ctx = buffersrc_ctx;
-    fctx->buffersink_ctx = buffersink_ctx;
-    fctx->filter_graph = filter_graph;
-
-end:
-    avfilter_inout_free(&inputs);
-    avfilter_inout_free(&outputs);
-    /*
-    printf("filter video ok\n");
-    */
-    return ret;
+    fctx->sws_ctx = sws_getContext(dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
+            fctx->scaled_width, fctx->scaled_height, AV_PIX_FMT_YUV420P,
+            SWS_BICUBIC, NULL, NULL, NULL);
+    fctx->frame_pool = av_buffer_pool_init(fctx->linesize[0] * height
+            + 2 * fctx->linesize[1] * (height / 2), av_buffer_alloc);
+    if (fctx->sws_ctx == NULL || fctx->frame_pool == NULL) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot scale %dx%d to %dx%d\n",
+                dec_ctx->width, dec_ctx->height, width, height);
+        return AVERROR(ENOMEM);
+    }
+    fctx->scale_entry = adaptive_pool_add(&key, pool_size);
+    if (fctx->scale_entry) {
+        fctx->scale_entry->sws_ctx = fctx->sws_ctx;
+        fctx->scale_entry->frame_pool = fctx->frame_pool;
+    }
+    return 0;
 }
 
-static int init_filters(int width, int height, AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx, FilteringContext *filter_ctx) {
-
-    //    const char *filter_spec;
-    char filter_spec[512];
+static int init_scalers(int width, int height, ngx_uint_t pool_size, AVFormatContext *ifmt_ctx,
+        FilteringContext *filter_ctx) {
     unsigned int i;
     int ret;
-    //    filter_ctx = av_malloc_array(ifmt_ctx->nb_streams, sizeof (*filter_ctx));
     if (!filter_ctx)
         return AVERROR(ENOMEM);
 
     for (i = 0; i < ifmt_ctx->nb_streams; i++) {
-        filter_ctx[i].buffersrc_ctx = NULL;
-        filter_ctx[i].buffersink_ctx = NULL;
-        filter_ctx[i].filter_graph = NULL;
-        if (!ifmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+        filter_ctx[i].sws_ctx = NULL;
+        filter_ctx[i].frame_pool = NULL;
+        if (ifmt_ctx->streams[i]->codec->codec_type != AVMEDIA_TYPE_VIDEO) {
             continue;
-        } else {
-            snprintf(filter_spec, sizeof (filter_spec),
-                    "scale=iw*min(%d/iw\\,%d/ih):ih*min(%d/iw\\,%d/ih)"
-                    ", pad=%d:%d:(%d-iw*min(%d/iw\\,"
-                    "%d/ih))/2:(%d-ih*min(%d/iw\\,%d/ih))/2",
-                    width, height, width, height, width, height, width, width, height,
-                    height, width, height);
-            ret = init_filter(&filter_ctx[i], ifmt_ctx->streams[i]->codec,
-                    ofmt_ctx->streams[i]->codec, filter_spec);
-            if (ret)
-                return ret;
         }
+        ret = init_video_scaler(width, height, pool_size, &filter_ctx[i]);
+        if (ret)
+            return ret;
     }
-    printf("init filter ok\n");
     return 0;
 }
 
-static int encode_write_frame(AVFrame *filt_frame, unsigned int stream_index, int *got_frame, AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx) {
+static void release_stream_context(FilteringContext *sctx, int reusable) {
+    if (sctx->dec_entry) {
+        adaptive_pool_release(sctx->dec_entry, reusable);
+    } else if (sctx->dec_ctx) {
+        avcodec_close(sctx->dec_ctx);
+        av_freep(&sctx->dec_ctx);
+    }
+    if (sctx->enc_entry) {
+        adaptive_pool_release(sctx->enc_entry, reusable);
+    } else {
+        if (sctx->enc_ctx) {
+            avcodec_close(sctx->enc_ctx);
+            av_freep(&sctx->enc_ctx);
+        }
+    }
+    if (sctx->scale_entry) {
+        adaptive_pool_release(sctx->scale_entry, reusable);
+    } else {
+        if (sctx->sws_ctx) sws_freeContext(sctx->sws_ctx);
+        /* pictures still referenced by the encoder keep the pool alive */
+        if (sctx->frame_pool) av_buffer_pool_uninit(&sctx->frame_pool);
+    }
+    if (sctx->swr_entry) {
+        adaptive_pool_release(sctx->swr_entry, reusable);
+    } else if (sctx->swr_ctx) {
+        swr_free(&sctx->swr_ctx);
+    }
+    if (sctx->fifo) av_audio_fifo_free(sctx->fifo);
+    sctx->fifo = NULL;
+    sctx->swr_ctx = NULL;
+    sctx->swr_entry = NULL;
+    sctx->dec_ctx = NULL;
+    sctx->enc_ctx = NULL;
+    sctx->sws_ctx = NULL;
+    sctx->frame_pool = NULL;
+}
+
+/* the array takes the packet over, it grows as needed */
+static int append_packet(AVPacket **packets, int *nb_packets, int *packets_size,
+        AVPacket *packet) {
+    AVPacket *p;
+
+    if (*nb_packets == *packets_size) {
+        p = av_realloc_array(*packets, *packets_size ? *packets_size * 2 : 64, sizeof (AVPacket));
+        if (p == NULL) return AVERROR(ENOMEM);
+        *packets = p;
+        *packets_size = *packets_size ? *packets_size * 2 : 64;
+    }
+    (*packets)[(*nb_packets)++] = *packet;
+    return 0;
+}
+
+static void free_packets(AVPacket **packets, int *nb_packets, int *packets_size) {
+    int i;
+    for (i = 0; i < *nb_packets; i++) av_free_packet(&(*packets)[i]);
+    av_freep(packets);
+    *nb_packets = 0;
+    *packets_size = 0;
+}
+
+static int encode_write_frame(AVFrame *filt_frame, unsigned int stream_index, int *got_frame,
+        AVFormatContext *ofmt_ctx, FilteringContext *stream_ctx) {
     int ret;
     int got_frame_local;
     AVPacket enc_pkt;
+    AVCodecContext *enc_ctx = stream_ctx[stream_index].enc_ctx;
 
     int (*enc_func)(AVCodecContext *, AVPacket *, const AVFrame *, int *) =
-            (ifmt_ctx->streams[stream_index]->codec->codec_type ==
-            AVMEDIA_TYPE_VIDEO) ? avcodec_encode_video2 : avcodec_encode_audio2;
+            (enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? avcodec_encode_video2 : avcodec_encode_audio2;
 
     if (!got_frame)
         got_frame = &got_frame_local;
@@ -517,11 +941,13 @@ static int encode_write_frame(AVFrame *filt_frame, unsigned int stream_index, in
     /* encode filtered frame */
     enc_pkt.data = NULL;
     enc_pkt.size = 0;
+    /*
+     * sized by the encoder: a packet may wait in the interleaving queue of the
+     * muxer, a buffer for the worst case picture would stay held meanwhile
+     */
     av_init_packet(&enc_pkt);
-
-    ret = enc_func(ofmt_ctx->streams[stream_index]->codec, &enc_pkt,
-            filt_frame, got_frame);
-    av_frame_free(&filt_frame);
+    ret = enc_func(enc_ctx, &enc_pkt, filt_frame, got_frame);
+    adaptive_frame_put(&filt_frame);
     if (ret < 0)
         return ret;
     if (!(*got_frame))
@@ -532,6 +958,10 @@ static int encode_write_frame(AVFrame *filt_frame, unsigned int stream_index, in
      * never change or optimize timestamp
      */
     enc_pkt.stream_index = stream_index;
+    /* audio is encoded in 1/sample_rate, video keeps the source time base */
+    if (ofmt_ctx && enc_ctx->codec_type == AVMEDIA_TYPE_AUDIO)
+        av_packet_rescale_ts(&enc_pkt, enc_ctx->time_base,
+            ofmt_ctx->streams[stream_index]->time_base);
     /*
     if (enc_pkt.pts != AV_NOPTS_VALUE) {
         av_packet_rescale_ts(&enc_pkt,
@@ -539,63 +969,171 @@ static int encode_write_frame(AVFrame *filt_frame, unsigned int stream_index, in
                 ofmt_ctx->streams[stream_index]->time_base);
     }
      */
+    if (ofmt_ctx == NULL) {
+        /* GOP job: muxed later, in order, by the request */
+        ret = append_packet(&stream_ctx[stream_index].packets, &stream_ctx[stream_index].nb_packets,
+                &stream_ctx[stream_index].packets_size, &enc_pkt);
+        if (ret < 0) av_free_packet(&enc_pkt);
+        return ret;
+    }
     /* mux encoded frame */
     ret = av_interleaved_write_frame(ofmt_ctx, &enc_pkt);
     return ret;
 }
 
-static int filter_encode_write_frame(AVFrame *frame, unsigned int stream_index,
-        AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx, FilteringContext *filter_ctx) {
-    int ret;
-    AVFrame *filt_frame;
-    //av_log(NULL, AV_LOG_INFO, "Pushing decoded frame to filters\n");
-    /* push the decoded frame into the filtergraph */
-    ret = av_buffersrc_add_frame_flags(filter_ctx[stream_index].buffersrc_ctx,
-            frame, 0);
-    if (ret < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
-        return ret;
+/* the rendition sized picture of a decoded frame, borders painted black */
+static AVFrame *scale_frame(AVFrame *frame, FilteringContext *fctx) {
+    AVFrame *scaled;
+    uint8_t *dst[4] = {NULL};
+    int dst_linesize[4] = {0};
+    int i, y, plane, w, h, px, py, sw, sh;
+
+    scaled = adaptive_frame_get();
+    if (scaled == NULL) return NULL;
+    scaled->buf[0] = av_buffer_pool_get(fctx->frame_pool);
+    if (scaled->buf[0] == NULL) {
+        adaptive_frame_put(&scaled);
+        return NULL;
     }
-    /* pull filtered frames from the filtergraph */
-    while (1) {
-        filt_frame = av_frame_alloc();
-        if (!filt_frame) {
-            ret = AVERROR(ENOMEM);
-            break;
+    scaled->format = AV_PIX_FMT_YUV420P;
+    scaled->width = fctx->width;
+    scaled->height = fctx->height;
+    scaled->data[0] = scaled->buf[0]->data;
+    scaled->data[1] = scaled->data[0] + fctx->linesize[0] * fctx->height;
+    scaled->data[2] = scaled->data[1] + fctx->linesize[1] * (fctx->height / 2);
+    scaled->extended_data = scaled->data;
+    for (i = 0; i < 3; i++) {
+        scaled->linesize[i] = fctx->linesize[i];
+        dst_linesize[i] = fctx->linesize[i];
+    }
+    /* padding is an offset into the planes, sws only writes the picture */
+    dst[0] = scaled->data[0] + fctx->pad_y * fctx->linesize[0] + fctx->pad_x;
+    dst[1] = scaled->data[1] + fctx->pad_y / 2 * fctx->linesize[1] + fctx->pad_x / 2;
+    dst[2] = scaled->data[2] + fctx->pad_y / 2 * fctx->linesize[2] + fctx->pad_x / 2;
+    sws_scale(fctx->sws_ctx, (const uint8_t * const *) frame->data, frame->linesize,
+            0, frame->height, dst, dst_linesize);
+
+    /* pooled buffers come back with any content, only the borders are redrawn */
+    if (fctx->pad_x || fctx->pad_y
+            || fctx->scaled_width != fctx->width || fctx->scaled_height != fctx->height) {
+        for (plane = 0; plane < 3; plane++) {
+            w = plane ? fctx->width / 2 : fctx->width;
+            h = plane ? fctx->height / 2 : fctx->height;
+            px = plane ? fctx->pad_x / 2 : fctx->pad_x;
+            py = plane ? fctx->pad_y / 2 : fctx->pad_y;
+            sw = plane ? fctx->scaled_width / 2 : fctx->scaled_width;
+            sh = plane ? fctx->scaled_height / 2 : fctx->scaled_height;
+            for (y = 0; y < h; y++) {
+                uint8_t *row = scaled->data[plane] + y * scaled->linesize[plane];
+                int black = plane ? 128 : 16;
+                if (y < py || y >= py + sh) {
+                    memset(row, black, w);
+                    continue;
+                }
+                memset(row, black, px);
+                memset(row + px + sw, black, w - px - sw);
+            }
         }
-        av_log(NULL, AV_LOG_DEBUG, "Pulling filtered frame from filters\n");
-        ret = av_buffersink_get_frame(filter_ctx[stream_index].buffersink_ctx,
-                filt_frame);
-        if (ret < 0) {
-            /* if no more frames for output - returns AVERROR(EAGAIN)
-             * if flushed and no more frames for output - returns AVERROR_EOF
-             * rewrite retcode to 0 to show it as normal procedure completion
-             */
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-                ret = 0;
-            av_frame_free(&filt_frame);
-            break;
+    }
+    scaled->pts = frame->pts;
+    scaled->key_frame = frame->key_frame;
+    scaled->sample_aspect_ratio = frame->sample_aspect_ratio;
+    return scaled;
+}
+
+static int scale_encode_write_frame(AVFrame *frame, unsigned int stream_index,
+        AVFormatContext *ofmt_ctx, FilteringContext *filter_ctx) {
+    AVFrame *scaled;
+
+    scaled = scale_frame(frame, &filter_ctx[stream_index]);
+    if (scaled == NULL) return AVERROR(ENOMEM);
+    scaled->pict_type = AV_PICTURE_TYPE_NONE;
+    /* key_frame is carried over from the decoded source frame */
+    if (filter_ctx[stream_index].force_key || scaled->key_frame) {
+        scaled->pict_type = AV_PICTURE_TYPE_I;
+        filter_ctx[stream_index].force_key = 0;
+    }
+    return encode_write_frame(scaled, stream_index, NULL, ofmt_ctx, filter_ctx);
+}
+
+/*
+ * resamples a decoded audio frame (NULL drains the resampler) and encodes
+ * every full encoder frame, the short tail only when draining
+ */
+static int resample_encode_write_frame(AVFrame *frame, unsigned int stream_index,
+        AVRational time_base, AVFormatContext *ofmt_ctx, FilteringContext *stream_ctx) {
+    FilteringContext *sctx = &stream_ctx[stream_index];
+    AVCodecContext *enc_ctx = sctx->enc_ctx;
+    uint8_t **samples = NULL;
+    AVFrame *out_frame;
+    int ret, n;
+
+    if (frame && sctx->next_pts == AV_NOPTS_VALUE && frame->pts != AV_NOPTS_VALUE)
+        sctx->next_pts = av_rescale_q(frame->pts, time_base, enc_ctx->time_base);
+    n = av_rescale_rnd(swr_get_delay(sctx->swr_ctx, sctx->dec_ctx->sample_rate)
+            + (frame ? frame->nb_samples : 0), enc_ctx->sample_rate,
+            sctx->dec_ctx->sample_rate, AV_ROUND_UP);
+    if (n > 0) {
+        ret = av_samples_alloc_array_and_samples(&samples, NULL, enc_ctx->channels, n,
+                enc_ctx->sample_fmt, 0);
+        if (ret < 0) return ret;
+        n = swr_convert(sctx->swr_ctx, samples, n,
+                frame ? (const uint8_t **) frame->extended_data : NULL,
+                frame ? frame->nb_samples : 0);
+        if (n > 0 && av_audio_fifo_write(sctx->fifo, (void **) samples, n) < n) n = AVERROR(ENOMEM);
+        av_freep(&samples[0]);
+        av_freep(&samples);
+        if (n < 0) return n;
+    }
+    while (av_audio_fifo_size(sctx->fifo) >= enc_ctx->frame_size
+            || (frame == NULL && av_audio_fifo_size(sctx->fifo) > 0)) {
+        out_frame = adaptive_frame_get();
+        if (out_frame == NULL) return AVERROR(ENOMEM);
+        out_frame->nb_samples = FFMIN(av_audio_fifo_size(sctx->fifo), enc_ctx->frame_size);
+        out_frame->format = enc_ctx->sample_fmt;
+        out_frame->channel_layout = enc_ctx->channel_layout;
+        out_frame->sample_rate = enc_ctx->sample_rate;
+        if ((ret = av_frame_get_buffer(out_frame, 0)) < 0) {
+            adaptive_frame_put(&out_frame);
+            return ret;
         }
-        filt_frame->pict_type = AV_PICTURE_TYPE_NONE;
-        ret = encode_write_frame(filt_frame, stream_index, NULL, ifmt_ctx, ofmt_ctx);
-        if (ret < 0)
-            break;
+        av_audio_fifo_read(sctx->fifo, (void **) out_frame->data, out_frame->nb_samples);
+        out_frame->pts = sctx->next_pts;
+        if (sctx->next_pts != AV_NOPTS_VALUE) sctx->next_pts += out_frame->nb_samples;
+        if ((ret = encode_write_frame(out_frame, stream_index, NULL, ofmt_ctx, stream_ctx)) < 0)
+            return ret;
     }
+    return 0;
+}
 
-    return ret;
+static int transcode_audio_packet(AVPacket *packet, AVRational time_base,
+        AVFormatContext *ofmt_ctx, FilteringContext *stream_ctx) {
+    AVFrame *frame;
+    int ret, got_frame;
+
+    frame = adaptive_frame_get();
+    if (frame == NULL) return AVERROR(ENOMEM);
+    ret = avcodec_decode_audio4(stream_ctx[packet->stream_index].dec_ctx, frame, &got_frame, packet);
+    if (ret >= 0 && got_frame) {
+        frame->pts = av_frame_get_best_effort_timestamp(frame);
+        ret = resample_encode_write_frame(frame, packet->stream_index, time_base, ofmt_ctx, stream_ctx);
+    }
+    adaptive_frame_put(&frame);
+    return ret < 0 ? ret : 0;
 }
 
-static int flush_encoder(unsigned int stream_index, AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx) {
+static int flush_encoder(unsigned int stream_index, AVFormatContext *ofmt_ctx,
+        FilteringContext *stream_ctx) {
     int ret;
     int got_frame;
 
-    if (!(ofmt_ctx->streams[stream_index]->codec->codec->capabilities &
+    if (!(stream_ctx[stream_index].enc_ctx->codec->capabilities &
             CODEC_CAP_DELAY))
         return 0;
 
     while (1) {
         //av_log(NULL, AV_LOG_INFO, "Flushing stream #%u encoder\n", stream_index);
-        ret = encode_write_frame(NULL, stream_index, &got_frame, ifmt_ctx, ofmt_ctx);
+        ret = encode_write_frame(NULL, stream_index, &got_frame, ofmt_ctx, stream_ctx);
         if (ret < 0)
             break;
         if (!got_frame)
@@ -604,7 +1142,18 @@ static int flush_encoder(unsigned int stream_index, AVFormatContext *ifmt_ctx, A
     return ret;
 }
 
-static int flush_decoder(unsigned int stream_index, AVFormatContext *ifmt_ctx) {
+/* drains resampler and encoder of a transcoded audio stream */
+static int flush_audio(unsigned int stream_index, AVFormatContext *ofmt_ctx,
+        FilteringContext *stream_ctx) {
+    int ret;
+    AVRational unused = {1, 1};
+
+    ret = resample_encode_write_frame(NULL, stream_index, unused, ofmt_ctx, stream_ctx);
+    if (ret < 0) return ret;
+    return flush_encoder(stream_index, ofmt_ctx, stream_ctx);
+}
+
+static int flush_decoder(unsigned int stream_index, FilteringContext *stream_ctx) {
     int ret;
     int got_frame;
     AVFrame *frame = NULL;
@@ -615,10 +1164,10 @@ static int flush_decoder(unsigned int stream_index, AVFormatContext *ifmt_ctx) {
             return 0;
      */
     while (1) {
-        frame = av_frame_alloc();
-        ret = avcodec_decode_video2(ifmt_ctx->streams[stream_index]->codec, frame,
+        frame = adaptive_frame_get();
+        ret = avcodec_decode_video2(stream_ctx[stream_index].dec_ctx, frame,
                 &got_frame, &packet);
-        av_frame_free(&frame);
+        adaptive_frame_put(&frame);
         if (ret < 0)
             break;
         if (!got_frame)
@@ -628,6 +1177,274 @@ static int flush_decoder(unsigned int stream_index, AVFormatContext *ifmt_ctx) {
     return ret;
 }
 
+typedef struct {
+    AVPacket *packets; // demuxed video, starting with a source IDR
+    int nb_packets;
+    int packets_size;
+    AVCodecContext *codec; // source stream parameters
+    ngx_http_estreaming_rendition_t *rendition;
+    ngx_estreaming_rung_t const *rate;
+    ngx_uint_t pool_size;
+    int global_header;
+    FilteringContext sctx; // encoded packets are left in sctx.packets
+    int ret;
+} adaptive_gop_t;
+
+/* runs on a transcode thread: decode, scale and encode one closed GOP */
+static void adaptive_gop_run(void *data) {
+    adaptive_gop_t *gop = data;
+    FilteringContext *sctx = &gop->sctx;
+    AVPacket flush = {.data = NULL, .size = 0};
+    AVPacket *packet;
+    AVFrame *frame;
+    int i, ret, got_frame;
+
+    sctx->single_thread = 1;
+    if ((ret = open_decoder(gop->codec, gop->rendition, gop->pool_size, sctx)) < 0)
+        goto end;
+    if ((ret = open_video_encoder(sctx->dec_ctx, gop->rendition, gop->rate, gop->global_header,
+            gop->pool_size, sctx)) < 0)
+        goto end;
+    if ((ret = init_video_scaler(gop->rendition->width, gop->rendition->height,
+            gop->pool_size, sctx)) < 0)
+        goto end;
+    /* the GOP, then empty packets until the decoder has no frame left */
+    for (i = 0;; i++) {
+        packet = i < gop->nb_packets ? &gop->packets[i] : &flush;
+        frame = adaptive_frame_get();
+        if (!frame) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        ret = avcodec_decode_video2(sctx->dec_ctx, frame, &got_frame, packet);
+        if (ret >= 0 && got_frame) {
+            frame->pts = av_frame_get_best_effort_timestamp(frame);
+            ret = scale_encode_write_frame(frame, 0, NULL, sctx);
+        }
+        adaptive_frame_put(&frame);
+        if (ret < 0)
+            goto end;
+        if (packet == &flush && !got_frame)
+            break;
+    }
+    ret = flush_encoder(0, NULL, sctx);
+end:
+    gop->ret = ret;
+    release_stream_context(sctx, ret == 0);
+}
+
+/*
+ * an IDR access unit: an open-GOP I-frame (recovery point, CRA) is followed
+ * by frames referencing the previous GOP, a job could not decode them alone
+ */
+static int adaptive_packet_idr(AVPacket const *packet, enum AVCodecID codec_id) {
+    uint8_t const *p = packet->data, *end = packet->data + packet->size;
+    int type;
+
+    if (!(packet->flags & AV_PKT_FLAG_KEY)) return 0;
+    /* annex b, as output_ts writes it */
+    for (; p + 3 < end; p++) {
+        if (p[0] != 0 || p[1] != 0 || p[2] != 1) continue;
+        p += 3;
+        if (codec_id == AV_CODEC_ID_H264) {
+            type = p[0] & 0x1f;
+            if (type == 5) return 1;
+            if (type >= 1 && type <= 4) return 0; // slice of another picture
+        } else {
+            type = (p[0] >> 1) & 0x3f;
+            if (type == 19 || type == 20) return 1; // IDR_W_RADL, IDR_N_LP
+            if (type < 32) return 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * reads the whole segment, cuts the video at source IDRs and encodes
+ * the GOPs on the transcode threads, then muxes them back in order with the
+ * remuxed audio. every GOP starts with a forced IDR, so they concatenate.
+ * on top of the source segment, which is in memory already, its demuxed
+ * packets and all encoded GOPs are held until the mux: about twice the source
+ * segment plus the transcoded one. nothing reaches the client before the mux,
+ * a client gone is noticed before the GOPs are encoded and while muxing.
+ */
+static int transcode_gops_parallel(video_buffer *destination,
+        AVFormatContext *ifmt_ctx, AVFormatContext *ofmt_ctx,
+        unsigned int video_index, ngx_http_estreaming_rendition_t *rendition,
+        ngx_estreaming_rung_t const *rate, ngx_uint_t pool_size, FilteringContext *filter_ctx) {
+    adaptive_gop_t *gops = NULL, *gop;
+    adaptive_task_t *tasks = NULL;
+    AVPacket packet, *others = NULL, *pkt, *video, *other;
+    AVRational video_tb = ifmt_ctx->streams[video_index]->time_base;
+    int nb_gops = 0, gops_size = 0, nb_others = 0, others_size = 0;
+    int ret, g, v, o;
+    unsigned int i;
+    int64_t delay, max_delay = 0;
+
+    while ((ret = av_read_frame(ifmt_ctx, &packet)) >= 0) {
+        if (destination->error) {
+            /* client is gone, nothing left to encode for */
+            av_free_packet(&packet);
+            ret = AVERROR(EIO);
+            break;
+        }
+        if ((ret = av_dup_packet(&packet)) < 0) {
+            av_free_packet(&packet);
+            break;
+        }
+        if (filter_ctx[packet.stream_index].swr_ctx) {
+            /* audio is cheap enough to stay on the request */
+            ret = transcode_audio_packet(&packet,
+                    ifmt_ctx->streams[packet.stream_index]->time_base, NULL, filter_ctx);
+            av_free_packet(&packet);
+            if (ret < 0) break;
+            continue;
+        } else if (packet.stream_index != (int) video_index) {
+            ret = append_packet(&others, &nb_others, &others_size, &packet);
+        } else {
+            if (nb_gops == 0 || adaptive_packet_idr(&packet,
+                    ifmt_ctx->streams[video_index]->codec->codec_id)) {
+                if (nb_gops == gops_size) {
+                    gop = av_realloc_array(gops, gops_size ? gops_size * 2 : 8, sizeof (adaptive_gop_t));
+                    if (gop == NULL) {
+                        av_free_packet(&packet);
+                        ret = AVERROR(ENOMEM);
+                        break;
+                    }
+                    gops = gop;
+                    gops_size = gops_size ? gops_size * 2 : 8;
+                }
+                gop = &gops[nb_gops++];
+                ngx_memzero(gop, sizeof (adaptive_gop_t));
+                gop->codec = ifmt_ctx->streams[video_index]->codec;
+                gop->rendition = rendition;
+                gop->rate = rate;
+                gop->pool_size = pool_size;
+                gop->global_header = ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER;
+            }
+            gop = &gops[nb_gops - 1];
+            ret = append_packet(&gop->packets, &gop->nb_packets, &gop->packets_size, &packet);
+        }
+        if (ret < 0) {
+            av_free_packet(&packet);
+            break;
+        }
+    }
+    if (ret == AVERROR_EOF)
+        ret = 0;
+    if (ret < 0)
+        goto end;
+    /* encoded audio joins the remuxed packets, muxing interleaves the streams */
+    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
+        if (!filter_ctx[i].swr_ctx) continue;
+        if ((ret = flush_audio(i, NULL, filter_ctx)) < 0)
+            goto end;
+        for (v = 0; v < filter_ctx[i].nb_packets; v++) {
+            pkt = &filter_ctx[i].packets[v];
+            av_packet_rescale_ts(pkt, filter_ctx[i].enc_ctx->time_base,
+                    ofmt_ctx->streams[i]->time_base);
+            if ((ret = append_packet(&others, &nb_others, &others_size, pkt)) < 0)
+                goto end;
+        }
+        /* moved, not freed */
+        av_freep(&filter_ctx[i].packets);
+        filter_ctx[i].nb_packets = 0;
+        filter_ctx[i].packets_size = 0;
+    }
+
+    if (adaptive_client_gone(destination)) {
+        ret = AVERROR(EIO);
+        goto end;
+    }
+    if (nb_gops) {
+        tasks = av_mallocz_array(nb_gops, sizeof (adaptive_task_t));
+        if (tasks == NULL) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        for (g = 0; g < nb_gops; g++) {
+            tasks[g].handler = adaptive_gop_run;
+            tasks[g].data = &gops[g];
+        }
+        adaptive_threads_run(tasks, nb_gops);
+        for (g = 0; g < nb_gops; g++) {
+            if ((ret = gops[g].ret) < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Transcoding GOP %d failed\n", g);
+                goto end;
+            }
+        }
+    }
+    /*
+     * each encoder starts its dts that much before the IDR, fewer frames give
+     * a shorter delay. with the same delay for every GOP the dts run on from
+     * one GOP to the next, the pts are left as encoded
+     */
+    for (g = 0; g < nb_gops; g++) {
+        if (gops[g].sctx.nb_packets == 0) continue;
+        pkt = &gops[g].sctx.packets[0];
+        if (pkt->pts == AV_NOPTS_VALUE || pkt->dts == AV_NOPTS_VALUE) continue;
+        max_delay = ngx_max(max_delay, pkt->pts - pkt->dts);
+    }
+    for (g = 0; g < nb_gops; g++) {
+        if (gops[g].sctx.nb_packets == 0) continue;
+        pkt = &gops[g].sctx.packets[0];
+        if (pkt->pts == AV_NOPTS_VALUE || pkt->dts == AV_NOPTS_VALUE) continue;
+        delay = max_delay - (pkt->pts - pkt->dts);
+        if (delay == 0) continue;
+        for (v = 0; v < gops[g].sctx.nb_packets; v++) {
+            pkt = &gops[g].sctx.packets[v];
+            if (pkt->dts != AV_NOPTS_VALUE) pkt->dts -= delay;
+        }
+    }
+
+    /* mux in dts order, GOP after GOP */
+    g = v = o = 0;
+    for (;;) {
+        while (g < nb_gops && v == gops[g].sctx.nb_packets) {
+            g++;
+            v = 0;
+        }
+        video = g < nb_gops ? &gops[g].sctx.packets[v] : NULL;
+        other = o < nb_others ? &others[o] : NULL;
+        if (video == NULL && other == NULL)
+            break;
+        if (destination->error) {
+            ret = AVERROR(EIO);
+            goto end;
+        }
+        if (video && (other == NULL || av_compare_ts(video->dts, video_tb, other->dts,
+                ifmt_ctx->streams[other->stream_index]->time_base) <= 0)) {
+            video->stream_index = video_index;
+            pkt = video;
+            v++;
+        } else {
+            pkt = other;
+            o++;
+        }
+        if ((ret = av_interleaved_write_frame(ofmt_ctx, pkt)) < 0)
+            goto end;
+        if (ofmt_ctx->pb->error < 0) {
+            ret = ofmt_ctx->pb->error;
+            goto end;
+        }
+    }
+    ret = av_write_trailer(ofmt_ctx);
+
+end:
+    for (g = 0; g < nb_gops; g++) {
+        free_packets(&gops[g].packets, &gops[g].nb_packets, &gops[g].packets_size);
+        free_packets(&gops[g].sctx.packets, &gops[g].sctx.nb_packets, &gops[g].sctx.packets_size);
+    }
+    free_packets(&others, &nb_others, &others_size);
+    for (i = 0; i < ifmt_ctx->nb_streams; i++) {
+        free_packets(&filter_ctx[i].packets, &filter_ctx[i].nb_packets,
+                &filter_ctx[i].packets_size);
+    }
+    av_free(gops);
+    av_free(tasks);
+    return ret;
+}
+
 int ngx_estreaming_adaptive_bitrate(ngx_http_request_t *req, ngx_chain_t *chain,
         video_buffer *destination, mp4_split_options_t *options) {
     int ret = 0;
@@ -644,67 +1461,103 @@ int ngx_estreaming_adaptive_bitrate(ngx_http_request_t *req, ngx_chain_t *chain,
     unsigned int i;
     unsigned int skipped = 0;
     int got_frame;
-    int height = 360;
-    int width = 640;
+    int height, width;
     int (*dec_func)(AVCodecContext *, AVFrame *, int *, const AVPacket *);
+    int64_t started = av_gettime();
+    hls_conf_t *conf = ngx_http_get_module_loc_conf(req, ngx_http_estreaming_module);
+    ngx_http_estreaming_rendition_t *rendition = options->rendition;
     // setup video resolution
-    if (options->video_resolution == 3) {
-        // 720p
-        width = 1280;
-        height = 720;
-    } else if (options->video_resolution == 2) {
-        // 480p
-        width = 854;
-        height = 480;
-    }
+    if (rendition == NULL) return 1;
+    width = rendition->width;
+    height = rendition->height;
     /* allocate memory for input format context*/
     ifmt_ctx = avformat_alloc_context();
-    if ((ret = open_input_file(req->pool, chain, width,
-            height, ifmt_ctx, &io_read_context)) < 0) {
+    if ((ret = open_input_file(req->pool, chain, rendition, conf->context_pool,
+            ifmt_ctx, &io_read_context, &filter_ctx)) < 0) {
         goto end;
     }
 
     /* allocate memory for output context */
     ofmt_ctx = avformat_alloc_context();
-    if ((ret = prepare_output_encoder(req, destination, ifmt_ctx, ofmt_ctx, width, height, &io_write_context)) < 0)
+    /* fMP4: ftyp and moov are the init segment, media segments start at a moof */
+    destination->fmp4 = options->rate.hevc;
+    destination->skip = options->rate.hevc && !options->init;
+    if ((ret = prepare_output_encoder(req, destination, ifmt_ctx, ofmt_ctx, rendition, &options->rate,
+            conf->context_pool, filter_ctx, &io_write_context)) < 0)
         goto end;
-    filter_ctx = av_malloc_array(ifmt_ctx->nb_streams, sizeof (*filter_ctx));
-    if ((ret = init_filters(width, height, ifmt_ctx, ofmt_ctx, filter_ctx)) < 0)
+    if (options->rate.hevc) {
+        avio_flush(ofmt_ctx->pb);
+        destination->skip = options->init;
+        if (options->init) {
+            /* lets the muxer free its tracks, the trailer itself is dropped */
+            av_write_trailer(ofmt_ctx);
+            goto end;
+        }
+    }
+    if (conf->transcode_threads > 1) {
+        /* GOP-parallel when there is exactly one video stream to encode */
+        int video_index = -1;
+        for (i = 0; i < ifmt_ctx->nb_streams; i++) {
+            if (ifmt_ctx->streams[i]->codec->codec_type != AVMEDIA_TYPE_VIDEO) continue;
+            video_index = video_index == -1 ? (int) i : -2;
+        }
+        /* GOPs are cut at IDR NAL units, other codecs stay serial */
+        if (video_index >= 0
+                && (ifmt_ctx->streams[video_index]->codec->codec_id == AV_CODEC_ID_H264
+                || ifmt_ctx->streams[video_index]->codec->codec_id == AV_CODEC_ID_HEVC)
+                && adaptive_threads_start(conf->transcode_threads, req->connection->log) > 1) {
+            ret = transcode_gops_parallel(destination, ifmt_ctx, ofmt_ctx, video_index, rendition,
+                    &options->rate, conf->context_pool, filter_ctx);
+            goto end;
+        }
+    }
+    if ((ret = init_scalers(width, height, conf->context_pool, ifmt_ctx, filter_ctx)) < 0)
         goto end;
     /* read all packets */
     while (1) {
         if ((ret = av_read_frame(ifmt_ctx, &packet)) < 0)
             break;
+        if (destination->error) {
+            /* client is gone, nothing left to encode for */
+            ret = AVERROR(EIO);
+            av_free_packet(&packet);
+            goto end;
+        }
         stream_index = packet.stream_index;
         type = ifmt_ctx->streams[packet.stream_index]->codec->codec_type;
         if (type == AVMEDIA_TYPE_VIDEO) {
-            if (filter_ctx[stream_index].filter_graph) {
-                frame = av_frame_alloc();
+            if (filter_ctx[stream_index].sws_ctx) {
+                frame = adaptive_frame_get();
                 if (!frame) {
                     ret = AVERROR(ENOMEM);
                     break;
                 }
                 dec_func = (type == AVMEDIA_TYPE_VIDEO) ? avcodec_decode_video2 :
                         avcodec_decode_audio4;
-                ret = dec_func(ifmt_ctx->streams[stream_index]->codec, frame,
+                ret = dec_func(filter_ctx[stream_index].dec_ctx, frame,
                         &got_frame, &packet);
                 if (ret < 0) {
-                    av_frame_free(&frame);
+                    adaptive_frame_put(&frame);
                     av_log(NULL, AV_LOG_ERROR, "Error occurred: No: %d, %s\n", ret, av_err2str(ret));
                     av_log(NULL, AV_LOG_ERROR, "Decoding failed\n");
                     break;
                 }
                 if (got_frame) {
                     frame->pts = av_frame_get_best_effort_timestamp(frame);
-                    ret = filter_encode_write_frame(frame, stream_index, ifmt_ctx, ofmt_ctx, filter_ctx);
-                    av_frame_free(&frame);
+                    ret = scale_encode_write_frame(frame, stream_index, ofmt_ctx, filter_ctx);
+                    adaptive_frame_put(&frame);
                     if (ret < 0)
                         goto end;
                 } else {
                     ++skipped;
-                    av_frame_free(&frame);
+                    adaptive_frame_put(&frame);
                 }
             }
+        } else if (filter_ctx[stream_index].swr_ctx) {
+            ret = transcode_audio_packet(&packet, ifmt_ctx->streams[stream_index]->time_base,
+                    ofmt_ctx, filter_ctx);
+            if (ret < 0)
+                goto end;
         } else {
             /* remux this frame without reencoding */
             //            av_packet_rescale_ts(&packet,
@@ -721,13 +1574,13 @@ int ngx_estreaming_adaptive_bitrate(ngx_http_request_t *req, ngx_chain_t *chain,
         stream_index = packet.stream_index;
         type = ifmt_ctx->streams[packet.stream_index]->codec->codec_type;
         if (type == AVMEDIA_TYPE_VIDEO) {
-            frame = av_frame_alloc();
-            ret = avcodec_decode_video2(ifmt_ctx->streams[stream_index]->codec
+            frame = adaptive_frame_get();
+            ret = avcodec_decode_video2(filter_ctx[stream_index].dec_ctx
                     , frame, &got_frame, &packet);
             if (got_frame) {
                 frame->pts = av_frame_get_best_effort_timestamp(frame);
-                ret = filter_encode_write_frame(frame, stream_index, ifmt_ctx, ofmt_ctx, filter_ctx);
-                av_frame_free(&frame);
+                ret = scale_encode_write_frame(frame, stream_index, ofmt_ctx, filter_ctx);
+                adaptive_frame_put(&frame);
                 if (ret < 0) {
                     goto end;
                 }
@@ -736,23 +1589,24 @@ int ngx_estreaming_adaptive_bitrate(ngx_http_request_t *req, ngx_chain_t *chain,
     }
     /* flush filters and encoders/decoders */
     for (i = 0; i < ifmt_ctx->nb_streams; i++) {
-        /* flush filter */
-        if (!filter_ctx[i].filter_graph)
+        if (filter_ctx[i].swr_ctx) {
+            if ((ret = flush_audio(i, ofmt_ctx, filter_ctx)) < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Flushing audio failed\n");
+                goto end;
+            }
             continue;
-        ret = filter_encode_write_frame(NULL, i, ifmt_ctx, ofmt_ctx, filter_ctx);
-        if (ret < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Flushing filter failed\n");
-            goto end;
         }
+        /* the scaler holds no frames */
+        if (!filter_ctx[i].sws_ctx)
+            continue;
         /* flush encoder */
-        /* we do not encode audio frame so just flush video encoder*/
         if (ifmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
-            ret = flush_decoder(i, ifmt_ctx);
+            ret = flush_decoder(i, filter_ctx);
             if (ret < 0) {
                 av_log(NULL, AV_LOG_ERROR, "Flushing decoder failed\n");
                 goto end;
             }
-            ret = flush_encoder(i, ifmt_ctx, ofmt_ctx);
+            ret = flush_encoder(i, ofmt_ctx, filter_ctx);
             if (ret < 0) {
                 av_log(NULL, AV_LOG_ERROR, "Flushing encoder failed\n");
                 goto end;
@@ -763,12 +1617,9 @@ int ngx_estreaming_adaptive_bitrate(ngx_http_request_t *req, ngx_chain_t *chain,
 end:
     for (i = 0; i < ifmt_ctx->nb_streams; i++) {
         //        if (ofmt_ctx && ofmt_ctx->nb_streams > i && ofmt_ctx->streams[i] && ofmt_ctx->streams[i]->codec) {
-        avcodec_close(ofmt_ctx->streams[i]->codec);
+        if (ofmt_ctx && ofmt_ctx->nb_streams > i) avcodec_close(ofmt_ctx->streams[i]->codec);
         //        }
-        avcodec_close(ifmt_ctx->streams[i]->codec);
-        if (filter_ctx && filter_ctx[i].filter_graph) {
-            avfilter_graph_free(&filter_ctx[i].filter_graph);
-        }
+        if (filter_ctx) release_stream_context(&filter_ctx[i], ret == 0);
     }
     if (filter_ctx) av_free(filter_ctx);
     if (io_read_context) av_free(io_read_context);
@@ -786,7 +1637,8 @@ end:
     if (io_write_context) av_free(io_write_context);
     if (ofmt_ctx && ofmt_ctx->nb_streams > 0) avformat_free_context(ofmt_ctx);
     av_free_packet(&packet);
-    av_frame_free(&frame);
+    adaptive_frame_put(&frame);
+    if (ret == 0 && !options->init) ngx_estreaming_preset_done(req, options, av_gettime() - started);
 
     return ret ? 1 : 0;
 }
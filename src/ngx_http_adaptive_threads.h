@@ -0,0 +1,154 @@
+/*
+ * File:   ngx_http_adaptive_threads.h
+ * Author:  - Hung Nguyen
+ *
+ * Worker threads for GOP-parallel transcoding.
+ * The handler still waits for its segment like before, but the GOPs of the
+ * segment are decoded and encoded on streaming_transcode_threads threads.
+ * Threads only run libav* code on memory they were handed, never nginx pools
+ * used by the event loop; a prefetch is posted with a pool of its own, see
+ * ngx_http_estreaming_prefetch.h.
+ */
+
+#include <pthread.h>
+
+#define NGX_ESTREAMING_THREADS_MAX 64
+
+typedef struct adaptive_task_s adaptive_task_t;
+
+typedef struct {
+    ngx_uint_t pending; // tasks of the batch not finished yet
+} adaptive_batch_t;
+
+struct adaptive_task_s {
+    void (*handler)(void *data);
+    void *data;
+    adaptive_batch_t *batch; // NULL: posted, the handler reports completion itself
+    adaptive_task_t *next;
+};
+
+static pthread_mutex_t adaptive_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t adaptive_threads_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t adaptive_threads_done = PTHREAD_COND_INITIALIZER;
+static pthread_t adaptive_threads[NGX_ESTREAMING_THREADS_MAX];
+static ngx_uint_t adaptive_threads_n;
+static adaptive_task_t *adaptive_threads_queue;
+static adaptive_task_t **adaptive_threads_last = &adaptive_threads_queue;
+static int adaptive_threads_exit;
+
+/* libavcodec needs a lock manager once codecs are opened from several threads */
+static int adaptive_lockmgr(void **mutex, enum AVLockOp op) {
+    switch (op) {
+        case AV_LOCK_CREATE:
+            *mutex = malloc(sizeof (pthread_mutex_t));
+            if (*mutex == NULL) return 1;
+            return pthread_mutex_init(*mutex, NULL) != 0;
+        case AV_LOCK_OBTAIN:
+            return pthread_mutex_lock(*mutex) != 0;
+        case AV_LOCK_RELEASE:
+            return pthread_mutex_unlock(*mutex) != 0;
+        case AV_LOCK_DESTROY:
+            pthread_mutex_destroy(*mutex);
+            free(*mutex);
+            *mutex = NULL;
+            return 0;
+    }
+    return 1;
+}
+
+static void *adaptive_threads_cycle(void *data) {
+    adaptive_task_t *task;
+    adaptive_batch_t *batch;
+
+    pthread_mutex_lock(&adaptive_threads_mutex);
+    for (;;) {
+        while (adaptive_threads_queue == NULL && !adaptive_threads_exit) {
+            pthread_cond_wait(&adaptive_threads_cond, &adaptive_threads_mutex);
+        }
+        if (adaptive_threads_exit) break;
+        task = adaptive_threads_queue;
+        adaptive_threads_queue = task->next;
+        if (adaptive_threads_queue == NULL) adaptive_threads_last = &adaptive_threads_queue;
+        /* a posted task may be reused as soon as its handler reported back */
+        batch = task->batch;
+        pthread_mutex_unlock(&adaptive_threads_mutex);
+
+        task->handler(task->data);
+
+        pthread_mutex_lock(&adaptive_threads_mutex);
+        if (batch && --batch->pending == 0) pthread_cond_broadcast(&adaptive_threads_done);
+    }
+    pthread_mutex_unlock(&adaptive_threads_mutex);
+    /* contexts pooled by this thread */
+    adaptive_pool_cleanup();
+    return NULL;
+}
+
+/*
+ * makes sure at least n threads are running, returns how many are. a
+ * prefetch starts them too
+ */
+static ngx_uint_t adaptive_threads_start(ngx_uint_t n, ngx_log_t *log) {
+    int err;
+
+    if (n > NGX_ESTREAMING_THREADS_MAX) n = NGX_ESTREAMING_THREADS_MAX;
+    pthread_mutex_lock(&adaptive_threads_mutex);
+    while (adaptive_threads_n < n) {
+        err = pthread_create(&adaptive_threads[adaptive_threads_n], NULL,
+                adaptive_threads_cycle, NULL);
+        if (err) {
+            ngx_log_error(NGX_LOG_ALERT, log, err, "pthread_create() failed");
+            break;
+        }
+        adaptive_threads_n++;
+    }
+    n = adaptive_threads_n;
+    pthread_mutex_unlock(&adaptive_threads_mutex);
+    return n;
+}
+
+/* runs all tasks on the threads and returns when every one is done */
+static void adaptive_threads_run(adaptive_task_t *tasks, ngx_uint_t n) {
+    adaptive_batch_t batch;
+    ngx_uint_t i;
+
+    batch.pending = n;
+    pthread_mutex_lock(&adaptive_threads_mutex);
+    for (i = 0; i < n; i++) {
+        tasks[i].batch = &batch;
+        tasks[i].next = NULL;
+        *adaptive_threads_last = &tasks[i];
+        adaptive_threads_last = &tasks[i].next;
+    }
+    pthread_cond_broadcast(&adaptive_threads_cond);
+    while (batch.pending) {
+        pthread_cond_wait(&adaptive_threads_done, &adaptive_threads_mutex);
+    }
+    pthread_mutex_unlock(&adaptive_threads_mutex);
+}
+
+/* queues a task nobody waits for */
+static void adaptive_threads_post(adaptive_task_t *task) {
+    pthread_mutex_lock(&adaptive_threads_mutex);
+    task->batch = NULL;
+    task->next = NULL;
+    *adaptive_threads_last = task;
+    adaptive_threads_last = &task->next;
+    pthread_cond_signal(&adaptive_threads_cond);
+    pthread_mutex_unlock(&adaptive_threads_mutex);
+}
+
+static void adaptive_threads_cleanup(void) {
+    ngx_uint_t i;
+
+    pthread_mutex_lock(&adaptive_threads_mutex);
+    adaptive_threads_exit = 1;
+    pthread_cond_broadcast(&adaptive_threads_cond);
+    pthread_mutex_unlock(&adaptive_threads_mutex);
+    for (i = 0; i < adaptive_threads_n; i++) {
+        pthread_join(adaptive_threads[i], NULL);
+    }
+    adaptive_threads_n = 0;
+}
+
+// End Of File
@@ -0,0 +1,338 @@
+/*
+ * File:   ngx_http_estreaming_admission.h
+ * Author:  - Hung Nguyen
+ *
+ * Admission control for adbr transcodes.
+ * A transcode runs on the worker for the whole segment, so when the node is
+ * saturated every new one only makes the others slower. The number of running
+ * transcodes is counted in shared memory across workers; requests above
+ * streaming_transcode_limit wait in a bounded queue until a slot is free or
+ * their deadline passes, after which they are served the org segment or
+ * answered 503 with Retry-After.
+ * Waiters take a ticket and a free slot goes to the oldest one, a request
+ * which just came in never overtakes the queue.
+ */
+
+#define NGX_ESTREAMING_ADMISSION_POLL 20 /* ms between two tries of a queued request */
+#define NGX_ESTREAMING_QUEUE_MAX 256 /* streaming_transcode_queue is capped to it */
+#define NGX_ESTREAMING_QUEUE_GRACE 5 /* s past its timeout a waiter is taken for dead */
+
+typedef struct {
+    time_t expires; // its worker died if it is still there then
+    unsigned gone : 1; // left, dropped once it reaches the head
+} ngx_estreaming_waiter_t;
+
+typedef struct {
+    ngx_atomic_t active; // transcodes running
+    ngx_atomic_t queued; // requests waiting for a slot
+    ngx_atomic_t admitted;
+    ngx_atomic_t passthrough; // served org segment instead
+    ngx_atomic_t rejected; // answered 503
+    ngx_atomic_t expired; // deadline passed while queued
+    ngx_atomic_t presets[NGX_ESTREAMING_PRESETS]; // segments encoded with each x264 preset
+    ngx_atomic_t late; // over streaming_transcode_deadline anyway
+    /* under the mutex of the zone, waiting tickets are head up to tickets */
+    ngx_uint_t tickets;
+    ngx_uint_t head;
+    ngx_estreaming_waiter_t waiters[NGX_ESTREAMING_QUEUE_MAX]; // by ticket modulo the size
+} ngx_estreaming_shctx_t;
+
+typedef struct {
+    ngx_event_t timer;
+    ngx_msec_t deadline;
+    ngx_estreaming_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+    ngx_uint_t ticket;
+    unsigned queued : 1;
+    unsigned admitted : 1;
+    /* what the handler had parsed and opened when it queued, retries resume with it */
+    unsigned m4s : 1;
+    mp4_split_options_t *options;
+    ngx_str_t path;
+    size_t root;
+    ngx_open_file_info_t of;
+    struct bucket_t *bucket;
+    ngx_str_t cache_name;
+} ngx_estreaming_admission_t;
+
+/* the zone of the running cycle, set by each worker at start */
+static ngx_shm_zone_t *ngx_estreaming_shm_zone;
+
+static ngx_int_t ngx_estreaming_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_slab_pool_t *shpool;
+    ngx_estreaming_shctx_t *sh;
+
+    if (data) {
+        /* reload, keep counting the transcodes of the old workers */
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+    sh = ngx_slab_alloc(shpool, sizeof (ngx_estreaming_shctx_t));
+    if (sh == NULL) return NGX_ERROR;
+    ngx_memzero(sh, sizeof (ngx_estreaming_shctx_t));
+    shpool->data = sh;
+    shm_zone->data = sh;
+    return NGX_OK;
+}
+
+/*
+ * the zone is added by the first directive of each configuration which needs
+ * the counters, on reload init gets the data of the old one
+ */
+static char *ngx_estreaming_admission_zone(ngx_conf_t *cf) {
+    ngx_str_t name = ngx_string("estreaming");
+    ngx_estreaming_main_conf_t *mcf;
+
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_estreaming_module);
+    if (mcf->shm_zone) return NGX_CONF_OK;
+    mcf->shm_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize,
+            &ngx_http_estreaming_module);
+    if (mcf->shm_zone == NULL) return NGX_CONF_ERROR;
+    mcf->shm_zone->init = ngx_estreaming_init_shm_zone;
+    return NGX_CONF_OK;
+}
+
+static char *ngx_estreaming_transcode_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    char *rv = ngx_conf_set_num_slot(cf, cmd, conf);
+    if (rv != NGX_CONF_OK) return rv;
+    return ngx_estreaming_admission_zone(cf);
+}
+
+/* increments counter unless it already reached limit, 0 is unlimited */
+static ngx_int_t ngx_estreaming_atomic_inc(ngx_atomic_t *counter, ngx_uint_t limit) {
+    ngx_atomic_uint_t n;
+
+    for (;;) {
+        n = *counter;
+        if (limit && n >= limit) return 0;
+        if (ngx_atomic_cmp_set(counter, n, n + 1)) return 1;
+    }
+}
+
+/* drops the waiters at the head of the queue which left, called locked */
+static void ngx_estreaming_queue_trim(ngx_estreaming_shctx_t *sh) {
+    ngx_estreaming_waiter_t *w;
+
+    while (sh->head != sh->tickets) {
+        w = &sh->waiters[sh->head % NGX_ESTREAMING_QUEUE_MAX];
+        if (!w->gone) {
+            if (w->expires >= ngx_time()) break;
+            ngx_atomic_fetch_add(&sh->queued, -1);
+        }
+        sh->head++;
+    }
+}
+
+/* called locked */
+static void ngx_estreaming_queue_leave(ngx_estreaming_admission_t *ctx) {
+    ngx_estreaming_shctx_t *sh = ctx->sh;
+
+    if (!ctx->queued) return;
+    ctx->queued = 0;
+    /* trimmed already, its worker was taken for dead */
+    if (ctx->ticket < sh->head) return;
+    sh->waiters[ctx->ticket % NGX_ESTREAMING_QUEUE_MAX].gone = 1;
+    ngx_atomic_fetch_add(&sh->queued, -1);
+    ngx_estreaming_queue_trim(sh);
+}
+
+static void ngx_estreaming_admission_dequeue(ngx_estreaming_admission_t *ctx) {
+    if (!ctx->queued) return;
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+    ngx_estreaming_queue_leave(ctx);
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+static void ngx_estreaming_admission_release(ngx_http_request_t *r) {
+    ngx_estreaming_admission_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_estreaming_module);
+    if (ctx == NULL || !ctx->admitted) return;
+    ngx_atomic_fetch_add(&ctx->sh->active, -1);
+    ctx->admitted = 0;
+}
+
+/* request pool is going away, whatever state it was left in */
+static void ngx_estreaming_admission_cleanup(void *data) {
+    ngx_http_request_t *r = data;
+    ngx_estreaming_admission_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_estreaming_module);
+    if (ctx == NULL) return;
+    if (ctx->timer.timer_set) ngx_del_timer(&ctx->timer);
+    ngx_estreaming_admission_dequeue(ctx);
+    ngx_estreaming_admission_release(r);
+}
+
+/* the handler resumes at the admission with what the ctx kept */
+static void ngx_estreaming_admission_handler(ngx_event_t *ev) {
+    ngx_http_request_t *r = ev->data;
+    ngx_connection_t *c = r->connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "estreaming admission retry");
+    if (c->error) {
+        /* the pool cleanup takes the request out of the queue */
+        ngx_http_finalize_request(r, NGX_HTTP_CLIENT_CLOSED_REQUEST);
+    } else {
+        ngx_http_finalize_request(r, ngx_estreaming_handler(r));
+    }
+    ngx_http_run_posted_requests(c);
+}
+
+/*
+ * NGX_OK: a transcode slot is held until ngx_estreaming_admission_release()
+ * NGX_AGAIN: queued, the handler is run again from a timer, the caller keeps
+ * its state in the ctx
+ * NGX_DECLINED: overloaded, conf->overload says what to serve
+ */
+static ngx_int_t ngx_estreaming_admission_acquire(ngx_http_request_t *r, hls_conf_t *conf) {
+    ngx_estreaming_shctx_t *sh;
+    ngx_estreaming_admission_t *ctx;
+    ngx_estreaming_waiter_t *w;
+    ngx_pool_cleanup_t *cln;
+    ngx_msec_int_t left;
+    ngx_uint_t first;
+
+    if (ngx_estreaming_shm_zone == NULL) return NGX_OK;
+    sh = ngx_estreaming_shm_zone->data;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_estreaming_module);
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(r->pool, sizeof (ngx_estreaming_admission_t));
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (ctx == NULL || cln == NULL) return NGX_ERROR;
+        ctx->sh = sh;
+        ctx->shpool = (ngx_slab_pool_t *) ngx_estreaming_shm_zone->shm.addr;
+        ctx->deadline = ngx_current_msec + conf->queue_timeout;
+        ctx->timer.handler = ngx_estreaming_admission_handler;
+        ctx->timer.data = r;
+        ctx->timer.log = r->connection->log;
+        cln->handler = ngx_estreaming_admission_cleanup;
+        cln->data = r;
+        ngx_http_set_ctx(r, ctx, ngx_http_estreaming_module);
+    }
+    if (ctx->admitted) return NGX_OK;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+    ngx_estreaming_queue_trim(sh);
+    /* first come first served, a slot is only taken with nobody older waiting */
+    first = ctx->queued ? ctx->ticket == sh->head : sh->head == sh->tickets;
+    if (first && ngx_estreaming_atomic_inc(&sh->active, conf->transcode_limit)) {
+        ngx_estreaming_queue_leave(ctx);
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ctx->admitted = 1;
+        ngx_atomic_fetch_add(&sh->admitted, 1);
+        return NGX_OK;
+    }
+
+    left = (ngx_msec_int_t) (ctx->deadline - ngx_current_msec);
+    if (!ctx->queued) {
+        if (left <= 0 || sh->queued >= conf->queue_size
+                || sh->tickets - sh->head >= NGX_ESTREAMING_QUEUE_MAX) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            goto overload;
+        }
+        ctx->ticket = sh->tickets++;
+        w = &sh->waiters[ctx->ticket % NGX_ESTREAMING_QUEUE_MAX];
+        w->expires = ngx_time() + conf->queue_timeout / 1000 + NGX_ESTREAMING_QUEUE_GRACE;
+        w->gone = 0;
+        ngx_atomic_fetch_add(&sh->queued, 1);
+        ctx->queued = 1;
+    } else if (left <= 0) {
+        ngx_estreaming_queue_leave(ctx);
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_atomic_fetch_add(&sh->expired, 1);
+        goto overload;
+    }
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_add_timer(&ctx->timer, ngx_min(left, NGX_ESTREAMING_ADMISSION_POLL));
+    return NGX_AGAIN;
+
+overload:
+    if (conf->overload == NGX_ESTREAMING_OVERLOAD_PASSTHROUGH) {
+        ngx_atomic_fetch_add(&sh->passthrough, 1);
+    } else {
+        ngx_atomic_fetch_add(&sh->rejected, 1);
+    }
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+            "transcode limit %ui reached, %s", conf->transcode_limit,
+            conf->overload == NGX_ESTREAMING_OVERLOAD_PASSTHROUGH ?
+            "serving original segment" : "rejecting");
+    return NGX_DECLINED;
+}
+
+static ngx_int_t ngx_estreaming_unavailable(ngx_http_request_t *r, hls_conf_t *conf) {
+    ngx_table_elt_t *h;
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    h->value.data = ngx_pnalloc(r->pool, NGX_TIME_T_LEN);
+    if (h->value.data == NULL) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    h->hash = 1;
+    ngx_str_set(&h->key, "Retry-After");
+    h->value.len = ngx_sprintf(h->value.data, "%T", conf->retry_after) - h->value.data;
+    return NGX_HTTP_SERVICE_UNAVAILABLE;
+}
+
+static ngx_int_t ngx_estreaming_status_handler(ngx_http_request_t *r) {
+    ngx_int_t rc;
+    ngx_buf_t *b;
+    ngx_chain_t out;
+    ngx_estreaming_shctx_t *sh;
+    size_t size;
+    ngx_uint_t i;
+
+    if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)))
+        return NGX_HTTP_NOT_ALLOWED;
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) return rc;
+
+    sh = ngx_estreaming_shm_zone->data;
+    size = sizeof ("transcode active: \n") + NGX_ATOMIC_T_LEN
+            + sizeof ("transcode queued: \n") + NGX_ATOMIC_T_LEN
+            + sizeof ("admitted passthrough rejected expired\n")
+            + 4 * (NGX_ATOMIC_T_LEN + 1)
+            + sizeof ("presets late\n") + NGX_ESTREAMING_PRESETS * sizeof ("veryslow ")
+            + (NGX_ESTREAMING_PRESETS + 1) * (NGX_ATOMIC_T_LEN + 1);
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    b->last = ngx_sprintf(b->last, "transcode active: %uA\n", sh->active);
+    b->last = ngx_sprintf(b->last, "transcode queued: %uA\n", sh->queued);
+    b->last = ngx_cpymem(b->last, "admitted passthrough rejected expired\n",
+            sizeof ("admitted passthrough rejected expired\n") - 1);
+    b->last = ngx_sprintf(b->last, "%uA %uA %uA %uA\n",
+            sh->admitted, sh->passthrough, sh->rejected, sh->expired);
+    b->last = ngx_cpymem(b->last, "presets", sizeof ("presets") - 1);
+    for (i = 0; i < NGX_ESTREAMING_PRESETS; i++) {
+        b->last = ngx_sprintf(b->last, " %V", &ngx_estreaming_preset_names[i]);
+    }
+    b->last = ngx_cpymem(b->last, " late\n", sizeof (" late\n") - 1);
+    for (i = 0; i < NGX_ESTREAMING_PRESETS; i++) {
+        b->last = ngx_sprintf(b->last, "%uA ", sh->presets[i]);
+    }
+    b->last = ngx_sprintf(b->last, "%uA\n", sh->late);
+    b->memory = 1;
+    b->last_buf = 1;
+    out.buf = b;
+    out.next = NULL;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) return rc;
+    return ngx_http_output_filter(r, &out);
+}
+
+static char *ngx_estreaming_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_core_loc_conf_t *clcf =
+            ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_estreaming_status_handler;
+    return ngx_estreaming_admission_zone(cf);
+}
+
+// End Of File
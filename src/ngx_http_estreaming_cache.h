@@ -0,0 +1,142 @@
+/*
+ * File:   ngx_http_estreaming_cache.h
+ * Author:  - Hung Nguyen
+ *
+ * Transcoded segment cache.
+ * adbr segments are stored under streaming_transcode_cache, one file per
+ * source, rendition, codec, segment, segment length and clip. The source mtime is part of
+ * the key so a replaced mp4 never serves stale segments; old entries are left
+ * to the operator (find -atime) to remove.
+ */
+
+static ngx_int_t ngx_estreaming_cache_name(ngx_pool_t *pool, ngx_path_t *cache,
+        ngx_str_t *source, time_t mtime, mp4_split_options_t const *options,
+        ngx_uint_t length, ngx_str_t *name) {
+    ngx_md5_t md5;
+    u_char digest[16], key[NGX_ESTREAMING_RENDITION_NAME_MAX + 5 * NGX_INT64_LEN
+            + sizeof (":hevc:init:clip::")];
+    u_char *p;
+
+    p = ngx_sprintf(key, ":%T:%V:%ui:%ui", mtime, &options->rendition->name,
+            (ngx_uint_t) options->fragment_start, length);
+    /* H.264 keys are the same as before HEVC variants existed */
+    if (options->hevc) p = ngx_sprintf(p, options->init ? ":hevc:init" : ":hevc");
+    if (options->clip_from || options->clip_to) {
+        p = ngx_sprintf(p, ":clip:%uL:%uL", options->clip_from, options->clip_to);
+    }
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, source->data, source->len);
+    ngx_md5_update(&md5, key, p - key);
+    ngx_md5_final(digest, &md5);
+
+    /* <cache>/<levels>/<md5>, levels are filled by ngx_create_hashed_filename */
+    name->len = cache->name.len + 1 + cache->len + 2 * 16;
+    name->data = ngx_pnalloc(pool, name->len + 1);
+    if (name->data == NULL) return NGX_ERROR;
+    p = ngx_cpymem(name->data, cache->name.data, cache->name.len);
+    *p++ = '/';
+    p = ngx_hex_dump(p + cache->len, digest, 16);
+    *p = '\0';
+    ngx_create_hashed_filename(cache, name->data, name->len);
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_estreaming_cache_exists(ngx_str_t *name) {
+    ngx_file_info_t fi;
+    return ngx_file_info(name->data, &fi) != NGX_FILE_ERROR;
+}
+
+/*
+ * written to a temporary name first so readers never see a partial segment.
+ * in is the slab chain of the transcoder, buffers already sent to the client
+ * had their pos moved so they are written from start.
+ */
+static ngx_int_t ngx_estreaming_cache_store(ngx_pool_t *pool, ngx_str_t *name,
+        ngx_chain_t *in, ngx_log_t *log) {
+    ngx_fd_t fd;
+    ngx_str_t temp;
+    ssize_t n;
+    u_char *p;
+
+    temp.len = name->len + 1 + NGX_INT_T_LEN;
+    temp.data = ngx_pnalloc(pool, temp.len + 1);
+    if (temp.data == NULL) return NGX_ERROR;
+    temp.len = ngx_sprintf(temp.data, "%V.%P", name, ngx_pid) - temp.data;
+    temp.data[temp.len] = '\0';
+
+    fd = ngx_open_file(temp.data, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+    if (fd == NGX_INVALID_FILE && ngx_errno == NGX_ENOENT) {
+        /* the level directories are created on demand */
+        if (ngx_create_full_path(temp.data, 0700) == 0) {
+            fd = ngx_open_file(temp.data, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                    NGX_FILE_DEFAULT_ACCESS);
+        }
+    }
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                ngx_open_file_n " \"%V\" failed", &temp);
+        return NGX_ERROR;
+    }
+    for (; in; in = in->next) {
+        for (p = in->buf->start; p < in->buf->last; p += n) {
+            n = ngx_write_fd(fd, p, in->buf->last - p);
+            if (n <= 0) {
+                ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                        ngx_write_fd_n " \"%V\" failed", &temp);
+                ngx_close_file(fd);
+                ngx_delete_file(temp.data);
+                return NGX_ERROR;
+            }
+        }
+    }
+    ngx_close_file(fd);
+    if (ngx_rename_file(temp.data, name->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                ngx_rename_file_n " \"%V\" to \"%V\" failed", &temp, name);
+        ngx_delete_file(temp.data);
+        return NGX_ERROR;
+    }
+    return NGX_OK;
+}
+
+/* serve a cached segment through the open file cache of the location */
+static ngx_int_t ngx_estreaming_cache_open(ngx_http_request_t *r, ngx_str_t *name,
+        bucket_t *bucket) {
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_open_file_info_t of;
+    ngx_buf_t *b;
+    ngx_file_t *file;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    ngx_memzero(&of, sizeof (ngx_open_file_info_t));
+    of.read_ahead = clcf->read_ahead;
+    of.directio = clcf->directio;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+    if (ngx_open_cached_file(clcf->open_file_cache, name, &of, r->pool) != NGX_OK
+            || !of.is_file || of.size == 0) {
+        return NGX_DECLINED;
+    }
+    b = ngx_pcalloc(r->pool, sizeof (ngx_buf_t));
+    file = ngx_pcalloc(r->pool, sizeof (ngx_file_t));
+    bucket->first = ngx_alloc_chain_link(r->pool);
+    if (b == NULL || file == NULL || bucket->first == NULL) return NGX_ERROR;
+    file->fd = of.fd;
+    file->name = *name;
+    file->log = r->connection->log;
+    file->directio = of.is_directio;
+    b->file = file;
+    b->file_pos = 0;
+    b->file_last = of.size;
+    b->in_file = 1;
+    b->last_buf = 1;
+    b->last_in_chain = 1;
+    bucket->first->buf = b;
+    bucket->first->next = NULL;
+    bucket->content_length = of.size;
+    return NGX_OK;
+}
+
+// End Of File
@@ -0,0 +1,237 @@
+/*
+ * File:   ngx_http_estreaming_ladder.h
+ * Author:  - Hung Nguyen
+ *
+ * Per-title bitrate ladder.
+ * The source bitrate is measured from the sample sizes of the index, per
+ * segment, without decoding anything. With streaming_per_title on, each rung
+ * is encoded at the rate the source needs at that size (never above the
+ * configured bitrate) with a VBV cap derived from the source peaks, and the
+ * master playlist advertises what the segments really weigh. The measure
+ * walks the whole index, each worker keeps it per file, length and clip.
+ * Rungs with hevc= are also offered as HEVC in fMP4 next to their H.264
+ * variant, players without HEVC support keep using the latter.
+ */
+
+#include <math.h>
+
+/* a rung never gets less than this share of its configured bitrate */
+#define NGX_ESTREAMING_LADDER_FLOOR 4
+/* VBV maxrate is at most this many times the target */
+#define NGX_ESTREAMING_LADDER_BURST 2
+/* targets are rounded so that pooled encoders are shared between titles */
+#define NGX_ESTREAMING_LADDER_STEP 50000
+/* mpeg-ts packetization, percent */
+#define NGX_ESTREAMING_TS_OVERHEAD 8
+/* measured titles kept by each worker */
+#define NGX_ESTREAMING_RATE_CACHE 64
+
+/* set at startup, libavcodec was built with libx265 */
+static ngx_uint_t ngx_estreaming_hevc;
+
+typedef struct {
+    ngx_uint_t video_average; // bit/s
+    ngx_uint_t video_peak; // bit/s of the heaviest segment
+    ngx_uint_t audio_average; // all audio tracks
+    ngx_uint_t width; // from tkhd
+    ngx_uint_t height;
+} ngx_estreaming_source_rate_t;
+
+typedef struct {
+    ngx_file_uniq_t uniq; // the mp4 as it was measured
+    time_t mtime;
+    off_t size;
+    ngx_uint_t seconds;
+    uint64_t clip_from;
+    uint64_t clip_to;
+    ngx_int_t rc;
+    ngx_estreaming_source_rate_t rate;
+    ngx_msec_t last_used;
+    unsigned used : 1;
+} ngx_estreaming_rate_entry_t;
+
+static ngx_estreaming_rate_entry_t ngx_estreaming_rates[NGX_ESTREAMING_RATE_CACHE];
+
+static ngx_uint_t ngx_estreaming_ts_rate(ngx_uint_t rate) {
+    return rate + rate * NGX_ESTREAMING_TS_OVERHEAD / 100;
+}
+
+/*
+ * video segments are cut like the media playlist, see moov_segment_next, a
+ * tail shorter than half a segment does not count for the peak
+ */
+static ngx_int_t ngx_estreaming_source_rate(struct mp4_context_t *mp4_context,
+        ngx_uint_t seconds, ngx_estreaming_source_rate_t *rate) {
+    moov_t const *moov = mp4_context->moov;
+    trak_t const *trak;
+    samples_t *sample, *last;
+    moov_segment_t segment;
+    uint64_t bytes, segment_bytes, timescale, duration;
+    uint32_t track_id;
+    ngx_uint_t segment_rate;
+
+    ngx_memzero(rate, sizeof (ngx_estreaming_source_rate_t));
+    if (!moov_build_index(mp4_context, mp4_context->moov)) return NGX_ERROR;
+
+    for (track_id = 0; track_id < moov->tracks_; ++track_id) {
+        trak = moov->traks_[track_id];
+        if (!trak->samples_ || !trak->samples_size_) continue;
+        timescale = trak->mdia_->mdhd_->timescale_;
+        duration = trak->mdia_->mdhd_->duration_;
+        if (timescale == 0 || duration == 0) continue;
+        last = trak->samples_ + trak->samples_size_;
+        bytes = 0;
+
+        if (trak->mdia_->hdlr_->handler_type_ == FOURCC('s', 'o', 'u', 'n')) {
+            for (sample = trak->samples_; sample != last; ++sample) bytes += sample->size_;
+            rate->audio_average += bytes * 8 * timescale / duration;
+            continue;
+        }
+        if (trak->mdia_->hdlr_->handler_type_ != FOURCC('v', 'i', 'd', 'e')
+                || rate->video_average) continue;
+
+        rate->width = trak->tkhd_->width_ >> 16;
+        rate->height = trak->tkhd_->height_ >> 16;
+        segment.last = NULL;
+        while (moov_segment_next(trak, seconds, &segment)) {
+            segment_bytes = 0;
+            for (sample = segment.first; sample != segment.last; ++sample) {
+                segment_bytes += sample->size_;
+            }
+            bytes += segment_bytes;
+            if (segment.duration && (segment.last != last
+                    || 2 * segment.duration >= seconds * timescale)) {
+                segment_rate = segment_bytes * 8 * timescale / segment.duration;
+                if (segment_rate > rate->video_peak) rate->video_peak = segment_rate;
+            }
+        }
+        rate->video_average = bytes * 8 * timescale / duration;
+        if (rate->video_peak < rate->video_average) rate->video_peak = rate->video_average;
+    }
+    return rate->video_average ? NGX_OK : NGX_DECLINED;
+}
+
+/*
+ * ngx_estreaming_source_rate of the opened, maybe clipped, mp4 of options,
+ * a source or one of its pre-encoded rungs
+ */
+static ngx_int_t ngx_estreaming_source_rate_cached(struct mp4_context_t *mp4_context,
+        mp4_split_options_t const *options, ngx_estreaming_source_rate_t *rate) {
+    ngx_estreaming_rate_entry_t *entry, *oldest = NULL;
+    ngx_file_info_t fi;
+    ngx_uint_t i;
+    ngx_int_t rc;
+
+    if (ngx_fd_info(mp4_context->file->fd, &fi) == NGX_FILE_ERROR) {
+        return ngx_estreaming_source_rate(mp4_context, options->length, rate);
+    }
+    for (i = 0; i < NGX_ESTREAMING_RATE_CACHE; i++) {
+        entry = &ngx_estreaming_rates[i];
+        if (entry->used && entry->uniq == ngx_file_uniq(&fi)
+                && entry->mtime == ngx_file_mtime(&fi) && entry->size == ngx_file_size(&fi)
+                && entry->seconds == options->length && entry->clip_from == options->clip_from
+                && entry->clip_to == options->clip_to) {
+            entry->last_used = ngx_current_msec;
+            *rate = entry->rate;
+            return entry->rc;
+        }
+        if (oldest == NULL || !entry->used
+                || (oldest->used && entry->last_used < oldest->last_used)) oldest = entry;
+    }
+
+    rc = ngx_estreaming_source_rate(mp4_context, options->length, rate);
+    if (rc == NGX_ERROR) return rc;
+    oldest->uniq = ngx_file_uniq(&fi);
+    oldest->mtime = ngx_file_mtime(&fi);
+    oldest->size = ngx_file_size(&fi);
+    oldest->seconds = options->length;
+    oldest->clip_from = options->clip_from;
+    oldest->clip_to = options->clip_to;
+    oldest->rc = rc;
+    oldest->rate = *rate;
+    oldest->last_used = ngx_current_msec;
+    oldest->used = 1;
+    return rc;
+}
+
+/*
+ * bits per pixel drop as the picture gets smaller, a rung needs about
+ * (its pixels / source pixels)^0.75 of the source bitrate
+ */
+static void ngx_estreaming_rung_rate(hls_conf_t const *conf,
+        ngx_http_estreaming_rendition_t const *rendition,
+        ngx_estreaming_source_rate_t const *source, ngx_estreaming_rung_t *rung) {
+    double ratio;
+    ngx_uint_t target, audio;
+
+    ngx_memzero(rung, sizeof (ngx_estreaming_rung_t));
+    rung->bitrate = rendition->bitrate;
+    rung->bandwidth = rendition->bandwidth;
+    if (!conf->per_title || source == NULL || source->video_average == 0
+            || source->width == 0 || source->height == 0) return;
+
+    ratio = (double) (rendition->width * rendition->height)
+            / (double) (source->width * source->height);
+    target = (ngx_uint_t) (source->video_average * pow(ratio, 0.75));
+    target = (target + NGX_ESTREAMING_LADDER_STEP - 1)
+            / NGX_ESTREAMING_LADDER_STEP * NGX_ESTREAMING_LADDER_STEP;
+    target = ngx_max(target, rendition->bitrate / NGX_ESTREAMING_LADDER_FLOOR);
+    target = ngx_min(target, rendition->bitrate);
+
+    rung->bitrate = target;
+    rung->maxrate = ngx_min(target * source->video_peak / source->video_average,
+            target * NGX_ESTREAMING_LADDER_BURST);
+    rung->maxrate = ngx_max(rung->maxrate, target);
+    rung->bufsize = rung->maxrate * 2;
+    audio = rendition->audio_bitrate ? rendition->audio_bitrate : source->audio_average;
+    rung->bandwidth = ngx_estreaming_ts_rate(rung->maxrate + audio);
+    rung->average_bandwidth = ngx_estreaming_ts_rate(rung->bitrate + audio);
+}
+
+/* general_level_idc (30 x level) of the smallest HEVC level fitting the picture */
+static ngx_uint_t ngx_estreaming_hevc_level(ngx_uint_t width, ngx_uint_t height) {
+    static ngx_uint_t const samples[] = {36864, 122880, 245760, 552960, 983040, 2228224};
+    static ngx_uint_t const levels[] = {30, 60, 63, 90, 93, 120, 150};
+    ngx_uint_t i;
+
+    for (i = 0; i < sizeof (samples) / sizeof (samples[0]); i++) {
+        if (width * height <= samples[i]) break;
+    }
+    return levels[i];
+}
+
+/*
+ * the HEVC variant of a rung: video rates scale with hevc= / bitrate, the
+ * audio and container share of the bandwidth stays the same
+ */
+static void ngx_estreaming_rung_hevc(ngx_http_estreaming_rendition_t const *rendition,
+        ngx_estreaming_rung_t *rung) {
+    ngx_uint_t bitrate = rung->bitrate, peak = ngx_max(rung->bitrate, rung->maxrate);
+
+    rung->hevc = 1;
+    rung->bitrate = bitrate * rendition->hevc_bitrate / rendition->bitrate;
+    rung->maxrate = rung->maxrate * rendition->hevc_bitrate / rendition->bitrate;
+    rung->bufsize = rung->bufsize * rendition->hevc_bitrate / rendition->bitrate;
+    rung->bandwidth -= ngx_estreaming_ts_rate(peak - ngx_max(rung->bitrate, rung->maxrate));
+    if (rung->average_bandwidth) {
+        rung->average_bandwidth -= ngx_estreaming_ts_rate(bitrate - rung->bitrate);
+    }
+}
+
+/* encoder settings of an adbr segment, before output_ts touches the index */
+static void ngx_estreaming_ladder_options(struct mp4_context_t *mp4_context,
+        mp4_split_options_t *options) {
+    hls_conf_t *conf = ngx_http_get_module_loc_conf(mp4_context->r, ngx_http_estreaming_module);
+    ngx_estreaming_source_rate_t source;
+
+    if (options->rendition == NULL) return;
+    if (!conf->per_title
+            || ngx_estreaming_source_rate_cached(mp4_context, options, &source) != NGX_OK) {
+        ngx_estreaming_rung_rate(conf, options->rendition, NULL, &options->rate);
+    } else {
+        ngx_estreaming_rung_rate(conf, options->rendition, &source, &options->rate);
+    }
+    if (options->hevc) ngx_estreaming_rung_hevc(options->rendition, &options->rate);
+}
+
+// End Of File
@@ -8,9 +8,19 @@
 #include "moov.h"
 #include "output_bucket.h"
 #include "view_count.h"
+#include "ngx_http_estreaming_ladder.h"
+#include "ngx_http_estreaming_variant.h"
 #include "output_m3u8.h"
 #include "output_ts.h"
+#include "ngx_http_adaptive_pool.h"
+#include "ngx_http_adaptive_threads.h"
+#include "ngx_http_estreaming_admission.h"
+#include "ngx_http_estreaming_preset.h"
+#include "ngx_http_estreaming_cache.h"
+#include "ngx_http_estreaming_playlist.h"
+#include "ngx_http_estreaming_sequence.h"
 #include "ngx_http_adaptive_streaming.h"
+#include "ngx_http_estreaming_prefetch.h"
 #include "mp4_module.h"
 #include "ngx_http_mp4_faststart.h"
 
@@ -35,20 +45,245 @@ static void *ngx_http_hls_create_conf(ngx_conf_t * cf) {
     conf->hls_proxy.len = 0;
     conf->mp4_buffer_size = NGX_CONF_UNSET_SIZE;
     conf->mp4_max_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->context_pool = NGX_CONF_UNSET_UINT;
+    conf->renditions = NGX_CONF_UNSET_PTR;
+    conf->transcode_limit = NGX_CONF_UNSET_UINT;
+    conf->queue_size = NGX_CONF_UNSET_UINT;
+    conf->queue_timeout = NGX_CONF_UNSET_MSEC;
+    conf->overload = NGX_CONF_UNSET_UINT;
+    conf->retry_after = NGX_CONF_UNSET;
+    conf->prefetch = NGX_CONF_UNSET_UINT;
+    conf->prefetch_idle = NGX_CONF_UNSET_MSEC;
+    conf->transcode_threads = NGX_CONF_UNSET_UINT;
+    conf->per_title = NGX_CONF_UNSET;
+    conf->deadline = NGX_CONF_UNSET_UINT;
+    conf->playlist_cache = NGX_CONF_UNSET_PTR;
+    conf->playlist_max_age = NGX_CONF_UNSET;
+    conf->lengths = NGX_CONF_UNSET_PTR;
+    conf->preencoded = NGX_CONF_UNSET;
     return conf;
 }
 
-static ngx_int_t ngx_http_hls_initialization() {
+static void *ngx_estreaming_create_main_conf(ngx_conf_t *cf) {
+    return ngx_pcalloc(cf->pool, sizeof (ngx_estreaming_main_conf_t));
+}
+
+static ngx_int_t ngx_http_hls_initialization(ngx_cycle_t *cycle) {
+    ngx_estreaming_main_conf_t *mcf;
+
+    /* the zone of the cycle this worker runs, a reload gives a new one */
+    mcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_estreaming_module);
+    ngx_estreaming_shm_zone = mcf ? mcf->shm_zone : NULL;
     av_register_all();
-    avfilter_register_all();
+    av_lockmgr_register(adaptive_lockmgr);
+    ngx_estreaming_hevc = avcodec_find_encoder_by_name("libx265") != NULL;
     av_log_set_level(AV_LOG_ERROR);
     return NGX_OK;
 }
 
+static void ngx_http_hls_exit_process(ngx_cycle_t *cycle) {
+    ngx_estreaming_prefetch_cleanup();
+    adaptive_threads_cleanup();
+    adaptive_pool_cleanup();
+}
+
+/* the ladder used before renditions became configurable */
+static ngx_http_estreaming_rendition_t ngx_estreaming_default_renditions[] = {
+    { ngx_string("360p"), 640, 360, 1000000, 1560000, ngx_string("medium"),
+        ngx_string("baseline"), ngx_string("3.0"),
+        ngx_string("bframes=16:no-scenecut"), 30, 100,
+        NGX_ESTREAMING_DECODE_QUALITY, 64000, 2, 0},
+    { ngx_string("480p"), 854, 480, 2000000, 3120000, ngx_string("medium"),
+        ngx_string("baseline"), ngx_string("3.0"),
+        ngx_string("bframes=16:no-scenecut"), 25, 90},
+    { ngx_string("720p"), 1280, 720, 3000000, 5120000, ngx_string("medium"),
+        ngx_string("baseline"), ngx_string("3.0"),
+        ngx_string("bframes=16:no-scenecut"), 20, 80}
+};
+
+/* bitrates are decimal: 800k = 800000 bit/s */
+static ngx_int_t ngx_estreaming_parse_bitrate(ngx_str_t *value) {
+    ngx_int_t n, scale = 1;
+    size_t len = value->len;
+
+    if (len == 0) return NGX_ERROR;
+    switch (value->data[len - 1]) {
+        case 'k':
+        case 'K':
+            scale = 1000;
+            len--;
+            break;
+        case 'm':
+        case 'M':
+            scale = 1000 * 1000;
+            len--;
+            break;
+    }
+    n = ngx_atoi(value->data, len);
+    if (n == NGX_ERROR || n == 0) return NGX_ERROR;
+    return n * scale;
+}
+
+static char *ngx_estreaming_segment_lengths(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    hls_conf_t *hcf = conf;
+    ngx_str_t *value;
+    ngx_uint_t i, *length;
+    ngx_int_t n;
+
+    if (hcf->lengths != NGX_CONF_UNSET_PTR) return "is duplicate";
+    hcf->lengths = ngx_array_create(cf->pool, cf->args->nelts - 1, sizeof (ngx_uint_t));
+    if (hcf->lengths == NULL) return NGX_CONF_ERROR;
+    value = cf->args->elts;
+    for (i = 1; i < cf->args->nelts; i++) {
+        n = ngx_atoi(value[i].data, value[i].len);
+        if (n == NGX_ERROR || n == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid segment length \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+        length = ngx_array_push(hcf->lengths);
+        if (length == NULL) return NGX_CONF_ERROR;
+        *length = n;
+    }
+    return NGX_CONF_OK;
+}
+
+static char *ngx_estreaming_rendition(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    hls_conf_t *hcf = conf;
+    ngx_str_t *value, v;
+    ngx_uint_t i;
+    ngx_int_t n;
+    u_char *x;
+    ngx_http_estreaming_rendition_t *rendition, *r;
+
+    value = cf->args->elts;
+    if (cf->args->nelts < 6) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "\"%V\" needs name, WxH, bitrate, preset and profile", &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+    if (hcf->renditions == NGX_CONF_UNSET_PTR) {
+        hcf->renditions = ngx_array_create(cf->pool, 4, sizeof (ngx_http_estreaming_rendition_t));
+        if (hcf->renditions == NULL) return NGX_CONF_ERROR;
+    }
+    r = hcf->renditions->elts;
+    for (i = 0; i < hcf->renditions->nelts; i++) {
+        if (r[i].name.len == value[1].len
+                && ngx_strncmp(r[i].name.data, value[1].data, value[1].len) == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate rendition \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+    rendition = ngx_array_push(hcf->renditions);
+    if (rendition == NULL) return NGX_CONF_ERROR;
+    ngx_memzero(rendition, sizeof (ngx_http_estreaming_rendition_t));
+    if (value[1].len == 0 || value[1].len > NGX_ESTREAMING_RENDITION_NAME_MAX) goto invalid;
+    rendition->name = value[1];
+
+    x = ngx_strlchr(value[2].data, value[2].data + value[2].len, 'x');
+    if (x == NULL) goto invalid;
+    n = ngx_atoi(value[2].data, x - value[2].data);
+    if (n == NGX_ERROR || n == 0 || n % 2) goto invalid;
+    rendition->width = n;
+    n = ngx_atoi(x + 1, value[2].data + value[2].len - x - 1);
+    if (n == NGX_ERROR || n == 0 || n % 2) goto invalid;
+    rendition->height = n;
+
+    n = ngx_estreaming_parse_bitrate(&value[3]);
+    if (n == NGX_ERROR) goto invalid;
+    rendition->bitrate = n;
+    rendition->bandwidth = n + n / 2;
+    rendition->preset = value[4];
+    rendition->profile = value[5];
+    ngx_str_set(&rendition->level, "3.0");
+    ngx_str_set(&rendition->x264opts, "no-scenecut");
+    rendition->qmin = 10;
+    rendition->qmax = 51;
+    rendition->audio_channels = 2;
+
+    for (i = 6; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "bandwidth=", 10) == 0) {
+            v.data = value[i].data + 10;
+            v.len = value[i].len - 10;
+            n = ngx_estreaming_parse_bitrate(&v);
+            if (n == NGX_ERROR) goto invalid_param;
+            rendition->bandwidth = n;
+        } else if (ngx_strncmp(value[i].data, "level=", 6) == 0) {
+            rendition->level.data = value[i].data + 6;
+            rendition->level.len = value[i].len - 6;
+        } else if (ngx_strncmp(value[i].data, "qmin=", 5) == 0) {
+            rendition->qmin = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (rendition->qmin == NGX_ERROR) goto invalid_param;
+        } else if (ngx_strncmp(value[i].data, "qmax=", 5) == 0) {
+            rendition->qmax = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (rendition->qmax == NGX_ERROR) goto invalid_param;
+        } else if (ngx_strncmp(value[i].data, "audio=", 6) == 0) {
+            v.data = value[i].data + 6;
+            v.len = value[i].len - 6;
+            n = ngx_estreaming_parse_bitrate(&v);
+            if (n == NGX_ERROR) goto invalid_param;
+            rendition->audio_bitrate = n;
+        } else if (ngx_strncmp(value[i].data, "audio_channels=", 15) == 0) {
+            n = ngx_atoi(value[i].data + 15, value[i].len - 15);
+            if (n != 1 && n != 2) goto invalid_param;
+            rendition->audio_channels = n;
+        } else if (ngx_strncmp(value[i].data, "audio_rate=", 11) == 0) {
+            n = ngx_atoi(value[i].data + 11, value[i].len - 11);
+            if (n == NGX_ERROR || n < 8000 || n > 96000) goto invalid_param;
+            rendition->audio_rate = n;
+        } else if (ngx_strncmp(value[i].data, "decode=", 7) == 0) {
+            v.data = value[i].data + 7;
+            v.len = value[i].len - 7;
+            if (v.len == 7 && ngx_strncmp(v.data, "quality", 7) == 0) {
+                rendition->decode = NGX_ESTREAMING_DECODE_QUALITY;
+            } else if (v.len == 4 && ngx_strncmp(v.data, "fast", 4) == 0) {
+                rendition->decode = NGX_ESTREAMING_DECODE_FAST;
+            } else if (v.len == 7 && ngx_strncmp(v.data, "fastest", 7) == 0) {
+                rendition->decode = NGX_ESTREAMING_DECODE_FASTEST;
+            } else {
+                goto invalid_param;
+            }
+        } else if (ngx_strncmp(value[i].data, "hevc=", 5) == 0) {
+            v.data = value[i].data + 5;
+            v.len = value[i].len - 5;
+            n = ngx_estreaming_parse_bitrate(&v);
+            if (n == NGX_ERROR) goto invalid_param;
+            rendition->hevc_bitrate = n;
+        } else if (ngx_strncmp(value[i].data, "x264opts=", 9) == 0) {
+            rendition->x264opts.data = value[i].data + 9;
+            rendition->x264opts.len = value[i].len - 9;
+        } else {
+            goto invalid_param;
+        }
+    }
+    if (rendition->hevc_bitrate) {
+        if (rendition->hevc_bitrate >= rendition->bitrate) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "hevc bitrate of rendition \"%V\" must be below its bitrate", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        /* fMP4 cannot carry the ADTS audio of the source segment as it is */
+        if (rendition->audio_bitrate == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "hevc rendition \"%V\" needs audio=", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+    return NGX_CONF_OK;
+
+invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid rendition \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+
+invalid_param:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
 static char *ngx_http_hls_merge_conf(ngx_conf_t *cf, void *parent, void *child) {
     hls_conf_t *prev = parent;
     hls_conf_t *conf = child;
     ngx_conf_merge_uint_value(conf->length, prev->length, 8);
+    ngx_conf_merge_ptr_value(conf->lengths, prev->lengths, NULL);
     ngx_conf_merge_value(conf->relative, prev->relative, 1);
     ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size, 512 * 1024);
     ngx_conf_merge_size_value(conf->max_buffer_size, prev->max_buffer_size,
@@ -59,12 +294,58 @@ static char *ngx_http_hls_merge_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_size_value(conf->mp4_max_buffer_size, prev->mp4_max_buffer_size,
             10 * 1024 * 1024);
     ngx_conf_merge_off_value(conf->mp4_enhance, prev->mp4_enhance, 0);
+    ngx_conf_merge_uint_value(conf->context_pool, prev->context_pool, 8);
+    ngx_conf_merge_ptr_value(conf->renditions, prev->renditions, NULL);
+    if (conf->renditions == NULL) {
+        ngx_uint_t i;
+        ngx_http_estreaming_rendition_t *rendition;
+        conf->renditions = ngx_array_create(cf->pool, 3, sizeof (ngx_http_estreaming_rendition_t));
+        if (conf->renditions == NULL) return NGX_CONF_ERROR;
+        for (i = 0; i < sizeof (ngx_estreaming_default_renditions)
+                / sizeof (ngx_estreaming_default_renditions[0]); i++) {
+            rendition = ngx_array_push(conf->renditions);
+            if (rendition == NULL) return NGX_CONF_ERROR;
+            *rendition = ngx_estreaming_default_renditions[i];
+        }
+    }
 
     if (conf->length < 1) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                 "video length must be equal or more than 1");
         return NGX_CONF_ERROR;
     }
+    if (conf->context_pool > NGX_ESTREAMING_POOL_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "streaming_context_pool must not be more than %d", NGX_ESTREAMING_POOL_MAX);
+        return NGX_CONF_ERROR;
+    }
+    ngx_conf_merge_uint_value(conf->transcode_limit, prev->transcode_limit, 0);
+    ngx_conf_merge_uint_value(conf->queue_size, prev->queue_size, 16);
+    ngx_conf_merge_msec_value(conf->queue_timeout, prev->queue_timeout, 1000);
+    ngx_conf_merge_uint_value(conf->overload, prev->overload,
+            NGX_ESTREAMING_OVERLOAD_PASSTHROUGH);
+    ngx_conf_merge_value(conf->retry_after, prev->retry_after, 1);
+    if (conf->transcode_cache == NULL) {
+        conf->transcode_cache = prev->transcode_cache;
+    }
+    ngx_conf_merge_uint_value(conf->prefetch, prev->prefetch, 0);
+    ngx_conf_merge_msec_value(conf->prefetch_idle, prev->prefetch_idle, 10000);
+    ngx_conf_merge_uint_value(conf->transcode_threads, prev->transcode_threads, 0);
+    ngx_conf_merge_value(conf->per_title, prev->per_title, 0);
+    ngx_conf_merge_uint_value(conf->deadline, prev->deadline, 0);
+    ngx_conf_merge_ptr_value(conf->playlist_cache, prev->playlist_cache, NULL);
+    ngx_conf_merge_value(conf->playlist_max_age, prev->playlist_max_age, 0);
+    ngx_conf_merge_value(conf->preencoded, prev->preencoded, 0);
+    if (conf->transcode_threads > NGX_ESTREAMING_THREADS_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "streaming_transcode_threads must not be more than %d", NGX_ESTREAMING_THREADS_MAX);
+        return NGX_CONF_ERROR;
+    }
+    if (conf->queue_size > NGX_ESTREAMING_QUEUE_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "streaming_transcode_queue must not be more than %d", NGX_ESTREAMING_QUEUE_MAX);
+        return NGX_CONF_ERROR;
+    }
     return NGX_CONF_OK;
 }
 
@@ -72,10 +353,24 @@ static ngx_int_t ngx_estreaming_handler(ngx_http_request_t * r) {
     size_t root;
     ngx_int_t rc;
     ngx_uint_t level;
-    ngx_str_t path;
+    ngx_str_t path, uri, requested, source;
+    ngx_uint_t mapped;
     ngx_open_file_info_t of;
     ngx_http_core_loc_conf_t *clcf;
     video_buffer *destination;
+    ngx_str_t cache_name = ngx_null_string;
+    mp4_context_t *mp4_context = NULL;
+    u_char playlist_key[16], etag[16];
+    ngx_uint_t segments;
+    hls_conf_t *mlcf;
+    mp4_split_options_t *options;
+    ngx_log_t *nlog;
+    struct bucket_t *bucket;
+    ngx_estreaming_admission_t *ctx;
+    int result = 0;
+    u_int m3u8 = 0, len_ = 0, m4s = 0;
+    int64_t duration = 0;
+    ngx_uint_t literal = 0;
 
     if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)))
         return NGX_HTTP_NOT_ALLOWED;
@@ -83,14 +378,41 @@ static ngx_int_t ngx_estreaming_handler(ngx_http_request_t * r) {
     if (r->uri.data[r->uri.len - 1] == '/')
         return NGX_DECLINED;
 
+    mlcf = ngx_http_get_module_loc_conf(r, ngx_http_estreaming_module);
+    nlog = r->connection->log;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_estreaming_module);
+    if (ctx && ctx->options) {
+        /* admission retry, parsed and opened when it was queued */
+        options = ctx->options;
+        path = ctx->path;
+        root = ctx->root;
+        of = ctx->of;
+        bucket = ctx->bucket;
+        cache_name = ctx->cache_name;
+        m4s = ctx->m4s;
+        goto admission;
+    }
+
     rc = ngx_http_discard_request_body(r);
 
     if (rc != NGX_OK)
         return rc;
 
-    mp4_split_options_t * options = mp4_split_options_init(r);
+parse:
+    options = mp4_split_options_init(r);
 
-    if (!ngx_http_map_uri_to_path(r, &path, &root, 1)) {
+    uri = r->uri;
+    rc = literal ? NGX_OK : mp4_split_options_uri(r, options, &uri);
+    if (rc != NGX_OK) {
+        mp4_split_options_exit(r, options);
+        return rc == NGX_DECLINED ? NGX_HTTP_NOT_FOUND : NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    /* mapped as the URI of the mp4, r->uri is left as asked */
+    requested = r->uri;
+    r->uri = uri;
+    mapped = ngx_http_map_uri_to_path(r, &path, &root, 1) != NULL;
+    r->uri = requested;
+    if (!mapped) {
         mp4_split_options_exit(r, options);
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
@@ -99,12 +421,14 @@ static ngx_int_t ngx_estreaming_handler(ngx_http_request_t * r) {
         mp4_split_options_exit(r, options);
         return NGX_DECLINED;
     }
+    if (!mp4_split_options_length(mlcf, options->length)) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                "segment length %ui is not in streaming_segment_lengths", options->length);
+        mp4_split_options_exit(r, options);
+        return NGX_HTTP_BAD_REQUEST;
+    }
     if (!options) return NGX_DECLINED;
-    ngx_log_t * nlog = r->connection->log;
-    struct bucket_t * bucket = bucket_init(r);
-    int result = 0;
-    u_int m3u8 = 0, len_ = 0;
-    int64_t duration = 0;
+    bucket = bucket_init(r);
     if (ngx_memcmp(r->exten.data, "mp4", r->exten.len) == 0) {
         return ngx_http_mp4_handler(r);
     } else if (ngx_memcmp(r->exten.data, "m3u8", r->exten.len) == 0) {
@@ -113,15 +437,42 @@ static ngx_int_t ngx_estreaming_handler(ngx_http_request_t * r) {
         len_ = 1;
     } else if (ngx_memcmp(r->exten.data, "ts", r->exten.len) == 0) {
         // don't do anything 
+    } else if (ngx_memcmp(r->exten.data, "m4s", r->exten.len) == 0) {
+        m4s = 1;
     } else {
         return NGX_HTTP_UNSUPPORTED_MEDIA_TYPE;
     }
+    /* fMP4 only exists for the HEVC variant of a rung */
+    if (options->hevc || m4s) {
+        options->hevc = options->adbr && options->rendition
+                && options->rendition->hevc_bitrate && ngx_estreaming_hevc;
+        if (m4s && !options->hevc) {
+            mp4_split_options_exit(r, options);
+            return NGX_HTTP_NOT_FOUND;
+        }
+    }
+    if (m4s && !options->fragments) {
+        /* no segment number: the EXT-X-MAP segment, built from the first one */
+        options->init = 1;
+        options->fragments = 1;
+        options->fragment_start = 0;
+    }
     // change file name to mp4
     // in order to lookup file in filesystem
     char *ext = strrchr((const char *) path.data, '.');
     strcpy(ext, ".mp4");
     path.len = ((u_char *) ext - path.data) + 4;
     path.data[path.len] = '\0';
+    source = path;
+    if (options->org && options->rendition) {
+        /* a pre-encoded rung is served like the org segments, from its own file */
+        if (!mlcf->preencoded || options->hevc
+                || ngx_estreaming_variant_path(r->pool, &source, &options->rendition->name,
+                &path) != NGX_OK) {
+            mp4_split_options_exit(r, options);
+            return NGX_HTTP_NOT_FOUND;
+        }
+    }
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
     ngx_memzero(&of, sizeof (ngx_open_file_info_t));
     of.read_ahead = clcf->read_ahead;
@@ -131,6 +482,29 @@ static ngx_int_t ngx_estreaming_handler(ngx_http_request_t * r) {
     of.errors = clcf->open_file_cache_errors;
     of.events = clcf->open_file_cache_events;
     if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool) != NGX_OK) {
+        if (uri.data != r->uri.data && (of.err == NGX_ENOENT || of.err == NGX_ENOTDIR)) {
+            /* real org, adbr or numbered directories, not the layout of our playlists */
+            mp4_split_options_exit(r, options);
+            literal = 1;
+            goto parse;
+        }
+        if (m3u8 && of.err == NGX_ENOENT && !options->adbr && !options->org) {
+            /* no such mp4, maybe a sequence of them */
+            rc = ngx_estreaming_sequence(r, options, &path, bucket, &of.mtime, &segments);
+            if (rc == NGX_OK) {
+                char action[50];
+                sprintf(action, "ios_playlist&segments=%d", (int) segments);
+                view_count(NULL, (char *) path.data, options->hash, action);
+                ngx_estreaming_playlist_etag(bucket, etag);
+                r->allow_ranges = 0;
+                result = 1;
+                goto response;
+            }
+            if (rc != NGX_DECLINED) {
+                mp4_split_options_exit(r, options);
+                return rc;
+            }
+        }
         mp4_split_options_exit(r, options);
         switch (of.err) {
             case 0:
@@ -166,9 +540,75 @@ static ngx_int_t ngx_estreaming_handler(ngx_http_request_t * r) {
         }
         return NGX_DECLINED;
     }
+    if (m3u8 && mlcf->playlist_cache) {
+        if (ngx_estreaming_playlist_key(r, mlcf, options, &path, &of, playlist_key) != NGX_OK) {
+            mp4_split_options_exit(r, options);
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        rc = ngx_estreaming_playlist_get(r, mlcf->playlist_cache, playlist_key, bucket, etag,
+                &segments);
+        if (rc == NGX_ERROR) {
+            mp4_split_options_exit(r, options);
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        if (rc == NGX_OK) {
+            char action[50];
+            sprintf(action, "ios_playlist&segments=%d", (int) segments);
+            view_count(NULL, (char *) path.data, options->hash, action);
+            r->allow_ranges = 0;
+            result = 1;
+            goto response;
+        }
+    }
+    if (options->adbr && !m3u8 && !len_) {
+        /* a cached or refused segment never opens the mp4 */
+        if (mlcf->transcode_cache) {
+            if (ngx_estreaming_cache_name(r->pool, mlcf->transcode_cache, &path, of.mtime,
+                    options, options->length, &cache_name) != NGX_OK) {
+                mp4_split_options_exit(r, options);
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+            if (ngx_estreaming_cache_open(r, &cache_name, bucket) == NGX_OK) {
+                result = 1;
+                /* the mp4 is still needed to prefetch the next segments */
+                if (!mlcf->prefetch) goto cached;
+            }
+        }
+        if (!result) {
+admission:
+            if (ctx) ctx->options = NULL;
+            switch (ngx_estreaming_admission_acquire(r, mlcf)) {
+                case NGX_OK:
+                    break;
+                case NGX_AGAIN:
+                    // wait for a transcode slot
+                    ctx = ngx_http_get_module_ctx(r, ngx_http_estreaming_module);
+                    ctx->options = options;
+                    ctx->path = path;
+                    ctx->root = root;
+                    ctx->of = of;
+                    ctx->bucket = bucket;
+                    ctx->cache_name = cache_name;
+                    ctx->m4s = m4s;
+                    /* a client closing while queued gives its ticket back */
+                    r->read_event_handler = ngx_http_test_reading;
+                    r->main->count++;
+                    return NGX_DONE;
+                case NGX_DECLINED:
+                    /* the original segment is mpeg-ts, no use for an fMP4 request */
+                    if (mlcf->overload == NGX_ESTREAMING_OVERLOAD_PASSTHROUGH && !options->hevc) {
+                        options->adbr = 0;
+                        break;
+                    }
+                    mp4_split_options_exit(r, options);
+                    return ngx_estreaming_unavailable(r, mlcf);
+                default:
+                    mp4_split_options_exit(r, options);
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+    }
     /* move atom to beginning of file if it's in the last*/
-    hls_conf_t *mlcf;
-    mlcf = ngx_http_get_module_loc_conf(r, ngx_http_estreaming_module);
     if (mlcf->mp4_enhance == 1) {
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, nlog, 0,
                 "examine mp4 filename: \"%s\"", &path.data);
@@ -184,86 +624,67 @@ static ngx_int_t ngx_estreaming_handler(ngx_http_request_t * r) {
     file->fd = of.fd;
     file->name = path;
     file->log = nlog;
-    mp4_context_t *mp4_context = mp4_open(r, file, of.size, MP4_OPEN_MOOV);
+    mp4_context = mp4_open(r, file, of.size, MP4_OPEN_MOOV);
     if (!mp4_context) {
         mp4_split_options_exit(r, options);
         ngx_log_error(NGX_LOG_ALERT, nlog, ngx_errno, "mp4_open failed");
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
     mp4_context->root = root;
+    rc = moov_clip(mp4_context, options);
+    if (rc != NGX_OK) {
+        mp4_close(mp4_context);
+        mp4_split_options_exit(r, options);
+        return rc == NGX_DECLINED ? NGX_HTTP_BAD_REQUEST : NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
     if (m3u8 || len_) {
-        int ret, video_width = 0;
-        /*
-        only request for master playlist need to use ffmpeg api to open video
-        this takes time and cpu, we should avoid it as much as possible 
-         */
-        if ((m3u8) && (options->adbr || options->org)) goto no_ffmpeg;
-        AVFormatContext *fmt_ctx = NULL;
-        unsigned int i;
-//        av_register_all();
-        if ((ret = avformat_open_input(&fmt_ctx, (const char*) path.data, NULL, NULL)) < 0) {
-            mp4_split_options_exit(r, options);
-            mp4_close(mp4_context);
-            if (fmt_ctx) avformat_close_input(&fmt_ctx);
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
-        if ((ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0) {
-            if (fmt_ctx) avformat_close_input(&fmt_ctx);
-            mp4_close(mp4_context);
-            mp4_split_options_exit(r, options);
-            av_log(NULL, AV_LOG_ERROR, "Cannot find stream information\n");
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
+        int video_width = 0, video_height = 0;
+        /* everything comes from the moov mp4_open parsed already, no probing */
         if (len_) {
-            duration = fmt_ctx->duration;
-            u_char *buffer = (u_char *) ngx_palloc(mp4_context->r->pool, 10 * sizeof (char));
+            duration = moov_duration(mp4_context->moov);
+            u_char *buffer = (u_char *) ngx_palloc(mp4_context->r->pool, NGX_INT64_LEN + 2);
             u_char * p = buffer;
             if (buffer == NULL) {
                 mp4_split_options_exit(r, options);
                 mp4_close(mp4_context);
-                if (fmt_ctx) avformat_close_input(&fmt_ctx);
                 return NGX_HTTP_INTERNAL_SERVER_ERROR;
             }
-            // this is stolen from ffmpeg source code
-            if (duration != AV_NOPTS_VALUE) {
-                duration = duration + 5000;
-                int secs;
-                secs = duration / AV_TIME_BASE;
-                p = ngx_sprintf(p, "%02d\n", secs);
+            if (duration >= 0) {
+                p = ngx_sprintf(p, "%02L\n", (duration + 5000) / 1000000);
             } else {
                 p = ngx_sprintf(p, "N/A\n");
             }
             bucket_insert(bucket, buffer, p - buffer);
             ngx_pfree(mp4_context->r->pool, buffer);
-            if (fmt_ctx) avformat_close_input(&fmt_ctx);
             r->allow_ranges = 0;
             result = 1;
             goto response;
-        } else {
-            for (i = 0; i < fmt_ctx->nb_streams; i++) {
-                AVStream *stream;
-                AVCodecContext *codec_ctx;
-                stream = fmt_ctx->streams[i];
-                codec_ctx = stream->codec;
-                if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-                    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, nlog, 0,
-                            "source video w:%d", codec_ctx->width);
-                    if (video_width < codec_ctx->width) {
-                        video_width = codec_ctx->width;
-                    } else
-                        break;
-                }
-            }
-            avformat_close_input(&fmt_ctx);
         }
-no_ffmpeg:
-        if ((result = mp4_create_m3u8(mp4_context, bucket, options, video_width, path))) {
+        /* media playlists do not need the size */
+        if (!options->adbr && !options->org) {
+            moov_video_size(mp4_context->moov, &video_width, &video_height);
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, nlog, 0, "source video w:%d", video_width);
+        }
+        if ((result = mp4_create_m3u8(mp4_context, bucket, options, video_width, video_height, source))) {
             char action[50];
             sprintf(action, "ios_playlist&segments=%d", result);
             view_count(mp4_context, (char *) path.data, options ? options->hash : NULL, action);
+            ngx_estreaming_playlist_etag(bucket, etag);
+            if (mlcf->playlist_cache) {
+                ngx_estreaming_playlist_put(mlcf->playlist_cache, playlist_key, etag, bucket,
+                        result);
+            }
         }
         r->allow_ranges = 0;
     } else {
+        if (options->adbr && mlcf->transcode_cache) {
+            ngx_estreaming_prefetch_schedule(r, mp4_context, options, &path, of.mtime);
+            if (result) goto cached;
+        }
+        if (options->adbr) {
+            ngx_estreaming_ladder_options(mp4_context, options);
+            ngx_estreaming_preset_select(mp4_context, options);
+        }
         result = output_ts(mp4_context, bucket, options);
         if (!options || !result) {
             mp4_close(mp4_context);
@@ -273,31 +694,53 @@ no_ffmpeg:
 
         if (options->adbr) {
             destination = ngx_pcalloc(r->pool, sizeof (video_buffer));
-            destination->data = NULL;
-            destination->len = 0;
+            if (destination == NULL) {
+                mp4_close(mp4_context);
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
             destination->pool = r->pool;
-            if (ngx_estreaming_adaptive_bitrate(r, bucket->first,
-                    destination, options) == NGX_OK) {
-                ngx_buf_t *b = ngx_pcalloc(r->pool, sizeof (ngx_buf_t));
-                if (b == NULL) {
-                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            destination->r = r;
+            r->headers_out.last_modified_time = of.mtime;
+            rc = ngx_estreaming_adaptive_bitrate(r, bucket->first, destination, options);
+            ngx_estreaming_admission_release(r);
+            if (destination->header_sent) {
+                /* part of the segment is out already, too late for the original */
+                if (rc == NGX_OK && !destination->error) {
+                    rc = write_adbr_flush(destination, 1);
+                    if (rc != NGX_ERROR && cache_name.len) {
+                        ngx_estreaming_cache_store(r->pool, &cache_name, destination->first, nlog);
+                    }
+                } else {
+                    rc = NGX_ERROR;
                 }
-                bucket->first->buf = b;
-                bucket->first->next = NULL;
-                b->pos = destination->data;
-                b->last = destination->data + (destination->len * sizeof (unsigned char));
-                b->memory = 1;
-                b->last_buf = 1;
+                view_count(mp4_context, (char *) path.data, options->hash, "ios_view");
+                mp4_close(mp4_context);
+                mp4_split_options_exit(r, options);
+                return rc;
+            }
+            if (options->hevc && (rc != NGX_OK || destination->first == NULL)) {
+                mp4_close(mp4_context);
+                mp4_split_options_exit(r, options);
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+            if (rc == NGX_OK && destination->first) {
+                /* the slabs are sent as they are, no flattening */
+                destination->tail->buf->last_buf = 1;
+                destination->tail->buf->last_in_chain = 1;
+                bucket->first = destination->first;
                 bucket->content_length = destination->len;
+                if (cache_name.len) {
+                    ngx_estreaming_cache_store(r->pool, &cache_name, destination->first, nlog);
+                }
             }
             ngx_pfree(r->pool, destination);
         }
-        char action[50] = "ios_view";
-        view_count(mp4_context, (char *) path.data, options->hash, action);
+cached:
+        view_count(mp4_context, (char *) path.data, options->hash, "ios_view");
         r->allow_ranges = 1;
     }
 response:
-    mp4_close(mp4_context);
+    if (mp4_context) mp4_close(mp4_context);
     mp4_split_options_exit(r, options);
     result = result == 0 ? 415 : 200;
     r->root_tested = !r->error_page;
@@ -309,11 +752,18 @@ response:
         r->headers_out.content_length_n = bucket->content_length;
         r->headers_out.last_modified_time = of.mtime;
         if (m3u8) {
+            /* If-None-Match is answered by the not modified filter */
+            if (ngx_estreaming_playlist_headers(r, mlcf, etag) != NGX_OK) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
             r->headers_out.content_type.len = sizeof ("application/vnd.apple.mpegurl") - 1;
             r->headers_out.content_type.data = (u_char *) "application/vnd.apple.mpegurl";
         } else if (len_) {
             r->headers_out.content_type.len = sizeof ("text/html") - 1;
             r->headers_out.content_type.data = (u_char *) "text/html";
+        } else if (m4s) {
+            r->headers_out.content_type.len = sizeof ("video/mp4") - 1;
+            r->headers_out.content_type.data = (u_char *) "video/mp4";
         } else {
             r->headers_out.content_type.len = sizeof ("video/MP2T") - 1;
             r->headers_out.content_type.data = (u_char *) "video/MP2T";
@@ -39,6 +39,58 @@
 # define UNUSED(x) x
 #endif
 
+#define NGX_ESTREAMING_RENDITION_NAME_MAX 32
+
+#define NGX_ESTREAMING_OVERLOAD_PASSTHROUGH 1
+#define NGX_ESTREAMING_OVERLOAD_UNAVAILABLE 2
+
+#define NGX_ESTREAMING_DECODE_QUALITY 0
+#define NGX_ESTREAMING_DECODE_FAST 1
+#define NGX_ESTREAMING_DECODE_FASTEST 2
+
+/* x264 presets, fastest first */
+#define NGX_ESTREAMING_PRESETS 9
+
+/* audio rungs up to this bitrate are encoded HE-AAC, above AAC-LC */
+#define NGX_ESTREAMING_HE_AAC_MAX 64000
+
+/*
+ * one rung of the adaptive bitrate ladder:
+ * streaming_rendition name WxH bitrate preset profile [bandwidth=] [level=]
+ *                     [qmin=] [qmax=] [decode=] [audio=] [audio_channels=]
+ *                     [audio_rate=] [hevc=] [x264opts=]
+ */
+typedef struct {
+    ngx_str_t name; // path component: adbr/<name>/...
+    ngx_uint_t width;
+    ngx_uint_t height;
+    ngx_uint_t bitrate; // encoder target bitrate, bit/s
+    ngx_uint_t bandwidth; // BANDWIDTH advertised in master playlist
+    ngx_str_t preset;
+    ngx_str_t profile;
+    ngx_str_t level;
+    ngx_str_t x264opts;
+    ngx_int_t qmin;
+    ngx_int_t qmax;
+    ngx_uint_t decode; // NGX_ESTREAMING_DECODE_*, source decode when downscaling
+    ngx_uint_t audio_bitrate; // fdk-aac bit/s, 0 = source audio remuxed
+    ngx_uint_t audio_channels;
+    ngx_uint_t audio_rate; // Hz, 0 = source rate
+    ngx_uint_t hevc_bitrate; // libx265 bit/s of the fMP4 variant, 0 = H.264 only
+} ngx_http_estreaming_rendition_t;
+
+/* what a rung is encoded at for one title, see ngx_http_estreaming_ladder.h */
+typedef struct {
+    ngx_uint_t bitrate; // encoder target, bit/s
+    ngx_uint_t maxrate; // VBV, 0 = none
+    ngx_uint_t bufsize;
+    ngx_uint_t bandwidth; // BANDWIDTH of the master playlist
+    ngx_uint_t average_bandwidth; // AVERAGE-BANDWIDTH, 0 = not advertised
+    ngx_int_t preset; // index in ngx_estreaming_preset_names, -1 = preset of the rendition
+    ngx_msec_t duration; // of the segment, 0 = unknown
+    ngx_flag_t hevc; // libx265 into fMP4 instead of x264 into mpeg-ts
+} ngx_estreaming_rung_t;
+
 typedef struct {
     ngx_uint_t length;
     ngx_flag_t relative;
@@ -49,8 +101,29 @@ typedef struct {
     size_t mp4_buffer_size;
     size_t mp4_max_buffer_size;
     ngx_flag_t mp4_enhance; // fix mp4 file 
+    ngx_uint_t context_pool; // opened codec/scaler contexts kept per worker
+    ngx_array_t *renditions; // of ngx_http_estreaming_rendition_t
+    ngx_uint_t transcode_limit; // concurrent transcodes on the node, 0 = unlimited
+    ngx_uint_t queue_size; // requests allowed to wait for a transcode slot
+    ngx_msec_t queue_timeout;
+    ngx_uint_t overload; // NGX_ESTREAMING_OVERLOAD_*
+    time_t retry_after;
+    ngx_path_t *transcode_cache; // transcoded segments, NULL = no cache
+    ngx_uint_t prefetch; // segments transcoded ahead of the player
+    ngx_msec_t prefetch_idle;
+    ngx_uint_t transcode_threads; // GOPs of a segment encoded in parallel, 0 = serial
+    ngx_flag_t per_title; // rung bitrates follow the source, see ngx_http_estreaming_ladder.h
+    ngx_uint_t deadline; // percent of the segment duration a transcode may take, 0 = off
+    ngx_shm_zone_t *playlist_cache; // generated playlists, NULL = no cache
+    time_t playlist_max_age; // Cache-Control of playlists, 0 = no-cache
+    ngx_flag_t preencoded; // <name>_<rendition>.mp4 served instead of transcoding
+    ngx_array_t *lengths; // of ngx_uint_t, length= accepted besides segment_length
 } hls_conf_t;
 
+typedef struct {
+    ngx_shm_zone_t *shm_zone; // counters of ngx_http_estreaming_admission.h, NULL = not needed
+} ngx_estreaming_main_conf_t;
+
 struct moov_t {
     struct unknown_atom_t *unknown_atoms_;
     struct mvhd_t *mvhd_;
@@ -93,10 +166,32 @@ struct mp4_context_t {
 };
 typedef struct mp4_context_t mp4_context_t;
 
+static ngx_int_t ngx_estreaming_handler(ngx_http_request_t *r);
 static char *ngx_estreaming(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_estreaming_transcode_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_estreaming_transcode_deadline(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_estreaming_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_estreaming_prefetch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_estreaming_rendition(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_estreaming_playlist_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_estreaming_segment_lengths(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static void *ngx_http_hls_create_conf(ngx_conf_t *cf);
 static char *ngx_http_hls_merge_conf(ngx_conf_t *cf, void *parent, void *child);
-static ngx_int_t ngx_http_hls_initialization();
+static void *ngx_estreaming_create_main_conf(ngx_conf_t *cf);
+static ngx_int_t ngx_http_hls_initialization(ngx_cycle_t *cycle);
+static void ngx_http_hls_exit_process(ngx_cycle_t *cycle);
+
+static ngx_conf_enum_t ngx_estreaming_overload[] = {
+    { ngx_string("passthrough"), NGX_ESTREAMING_OVERLOAD_PASSTHROUGH},
+    { ngx_string("unavailable"), NGX_ESTREAMING_OVERLOAD_UNAVAILABLE},
+    { ngx_null_string, 0}
+};
+
+static ngx_str_t ngx_estreaming_preset_names[NGX_ESTREAMING_PRESETS] = {
+    ngx_string("ultrafast"), ngx_string("superfast"), ngx_string("veryfast"),
+    ngx_string("faster"), ngx_string("fast"), ngx_string("medium"),
+    ngx_string("slow"), ngx_string("slower"), ngx_string("veryslow")
+};
 
 static ngx_command_t ngx_estreaming_commands[] = {
     { ngx_string("streaming"),
@@ -111,6 +206,12 @@ static ngx_command_t ngx_estreaming_commands[] = {
         NGX_HTTP_LOC_CONF_OFFSET,
         offsetof(hls_conf_t, length),
         NULL},
+    { ngx_string("streaming_segment_lengths"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_estreaming_segment_lengths,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL},
     { ngx_string("hls_relative"),
         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
         ngx_conf_set_flag_slot,
@@ -155,6 +256,108 @@ static ngx_command_t ngx_estreaming_commands[] = {
         NGX_HTTP_LOC_CONF_OFFSET,
         offsetof(hls_conf_t, mp4_enhance),
         NULL},    
+    { ngx_string("streaming_context_pool"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(hls_conf_t, context_pool),
+        NULL},
+    { ngx_string("streaming_rendition"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_2MORE,
+        ngx_estreaming_rendition,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL},
+    { ngx_string("streaming_transcode_limit"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_estreaming_transcode_limit,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(hls_conf_t, transcode_limit),
+        NULL},
+    { ngx_string("streaming_transcode_queue"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(hls_conf_t, queue_size),
+        NULL},
+    { ngx_string("streaming_transcode_queue_timeout"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(hls_conf_t, queue_timeout),
+        NULL},
+    { ngx_string("streaming_transcode_overload"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_enum_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(hls_conf_t, overload),
+        &ngx_estreaming_overload},
+    { ngx_string("streaming_transcode_retry_after"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_sec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(hls_conf_t, retry_after),
+        NULL},
+    { ngx_string("streaming_transcode_cache"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1234,
+        ngx_conf_set_path_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(hls_conf_t, transcode_cache),
+        NULL},
+    { ngx_string("streaming_prefetch"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_estreaming_prefetch,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(hls_conf_t, prefetch),
+        NULL},
+    { ngx_string("streaming_prefetch_idle"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(hls_conf_t, prefetch_idle),
+        NULL},
+    { ngx_string("streaming_transcode_threads"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(hls_conf_t, transcode_threads),
+        NULL},
+    { ngx_string("streaming_transcode_deadline"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_estreaming_transcode_deadline,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(hls_conf_t, deadline),
+        NULL},
+    { ngx_string("streaming_per_title"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(hls_conf_t, per_title),
+        NULL},
+    { ngx_string("streaming_playlist_cache"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_estreaming_playlist_cache,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL},
+    { ngx_string("streaming_playlist_max_age"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_sec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(hls_conf_t, playlist_max_age),
+        NULL},
+    { ngx_string("streaming_preencoded"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(hls_conf_t, preencoded),
+        NULL},
+    { ngx_string("streaming_status"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+        ngx_estreaming_status,
+        0,
+        0,
+        NULL},
         
         
     ngx_null_command
@@ -164,7 +367,7 @@ static ngx_http_module_t ngx_estreaming_module_ctx = {
     NULL, /* preconfiguration */
     NULL, /* postconfiguration */
 
-    NULL, /* create main configuration */
+    ngx_estreaming_create_main_conf, /* create main configuration */
     NULL, /* init main configuration */
 
     NULL, /* create server configuration */
@@ -185,7 +388,7 @@ ngx_module_t ngx_http_estreaming_module = {
     ngx_http_hls_initialization,
     NULL, /* init thread */
     NULL, /* exit thread */
-    NULL, /* exit process */
+    ngx_http_hls_exit_process, /* exit process */
     NULL, /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -0,0 +1,289 @@
+/*
+ * File:   ngx_http_estreaming_playlist.h
+ * Author:  - Hung Nguyen
+ *
+ * Playlist cache.
+ * Players poll playlists and CDNs revalidate them, but a playlist only
+ * changes with its mp4 or the configuration. With streaming_playlist_cache
+ * the generated master and media playlists are kept in shared memory, keyed
+ * by the file identity (inode, size, mtime) and everything mp4_create_m3u8
+ * reads from the request and the location; a hit never reads the moov.
+ * Every playlist carries the md5 of its content as a strong ETag, so the
+ * not modified filter answers If-None-Match with a 304.
+ */
+
+typedef struct {
+    ngx_rbtree_node_t node; // key is the crc32 of md5
+    ngx_queue_t queue; // most recently used first
+    u_char md5[16]; // of the key
+    u_char etag[16]; // of the playlist
+    ngx_uint_t segments;
+    size_t len;
+    u_char data[1];
+} ngx_estreaming_playlist_node_t;
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue;
+    ngx_uint_t generation; // bumped by every reload
+} ngx_estreaming_playlist_sh_t;
+
+/* configuration generation the workers of this cycle run with */
+static ngx_uint_t ngx_estreaming_playlist_generation;
+
+static void ngx_estreaming_playlist_insert(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+        ngx_rbtree_node_t *sentinel) {
+    ngx_rbtree_node_t **p;
+
+    for (;;) {
+        if (node->key != temp->key) {
+            p = node->key < temp->key ? &temp->left : &temp->right;
+        } else {
+            p = ngx_memcmp(((ngx_estreaming_playlist_node_t *) node)->md5,
+                    ((ngx_estreaming_playlist_node_t *) temp)->md5, 16) < 0 ?
+                    &temp->left : &temp->right;
+        }
+        if (*p == sentinel) break;
+        temp = *p;
+    }
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_int_t ngx_estreaming_playlist_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_slab_pool_t *shpool;
+    ngx_estreaming_playlist_sh_t *sh;
+
+    if (data) {
+        /* reload, entries of the old configuration are left to expire */
+        sh = data;
+        shm_zone->data = sh;
+        ngx_estreaming_playlist_generation = ++sh->generation;
+        return NGX_OK;
+    }
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+    sh = ngx_slab_alloc(shpool, sizeof (ngx_estreaming_playlist_sh_t));
+    if (sh == NULL) return NGX_ERROR;
+    ngx_memzero(sh, sizeof (ngx_estreaming_playlist_sh_t));
+    ngx_rbtree_init(&sh->rbtree, &sh->sentinel, ngx_estreaming_playlist_insert);
+    ngx_queue_init(&sh->queue);
+    /* a full zone is the normal state of an LRU */
+    shpool->log_nomem = 0;
+    shpool->data = sh;
+    shm_zone->data = sh;
+    return NGX_OK;
+}
+
+/* streaming_playlist_cache size|off, one zone for all locations */
+static char *ngx_estreaming_playlist_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    hls_conf_t *hcf = conf;
+    ngx_str_t *value = cf->args->elts;
+    ngx_str_t name = ngx_string("estreaming_playlist");
+    ssize_t size;
+
+    if (hcf->playlist_cache != NGX_CONF_UNSET_PTR) return "is duplicate";
+    if (value[1].len == 3 && ngx_strncmp(value[1].data, "off", 3) == 0) {
+        hcf->playlist_cache = NULL;
+        return NGX_CONF_OK;
+    }
+    size = ngx_parse_size(&value[1]);
+    if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid playlist cache size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+    hcf->playlist_cache = ngx_shared_memory_add(cf, &name, size, &ngx_http_estreaming_module);
+    if (hcf->playlist_cache == NULL) return NGX_CONF_ERROR;
+    hcf->playlist_cache->init = ngx_estreaming_playlist_init_zone;
+    return NGX_CONF_OK;
+}
+
+/*
+ * the location (renditions, streaming_hls_proxy, per title...) is part of the
+ * key through its address, valid for one configuration generation
+ */
+static ngx_int_t ngx_estreaming_playlist_key(ngx_http_request_t *r, hls_conf_t *conf,
+        mp4_split_options_t const *options, ngx_str_t *path, ngx_open_file_info_t *of,
+        u_char *digest) {
+    ngx_http_estreaming_rendition_t *rendition = conf->renditions->elts;
+    ngx_file_info_t fi;
+    ngx_str_t variant;
+    ngx_md5_t md5;
+    ngx_uint_t i;
+    u_char key[8 * NGX_INT64_LEN], *p;
+
+    p = ngx_sprintf(key, ":%p:%ui:%uL:%O:%T:%ui:%i:%ui:", conf, ngx_estreaming_playlist_generation,
+            (uint64_t) of->uniq, of->size, of->mtime, options->length, conf->relative,
+            ngx_estreaming_hevc);
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, path->data, path->len);
+    ngx_md5_update(&md5, key, p - key);
+    ngx_md5_update(&md5, r->args.data, r->args.len);
+    /* absolute playlist names carry the host */
+    if (!conf->relative) {
+        ngx_md5_update(&md5, " ", 1);
+        ngx_md5_update(&md5, r->headers_in.server.data, r->headers_in.server.len);
+    }
+    /* so do the pre-encoded files the master playlist lists */
+    for (i = 0; conf->preencoded && !options->adbr && !options->org
+            && i < conf->renditions->nelts; i++) {
+        if (ngx_estreaming_variant_path(r->pool, path, &rendition[i].name, &variant) != NGX_OK)
+            return NGX_ERROR;
+        if (ngx_file_info(variant.data, &fi) == NGX_FILE_ERROR) continue;
+        p = ngx_sprintf(key, ":%V:%uL:%O:%T", &rendition[i].name, (uint64_t) ngx_file_uniq(&fi),
+                ngx_file_size(&fi), ngx_file_mtime(&fi));
+        ngx_md5_update(&md5, key, p - key);
+    }
+    ngx_md5_final(digest, &md5);
+    return NGX_OK;
+}
+
+static ngx_estreaming_playlist_node_t *ngx_estreaming_playlist_find(
+        ngx_estreaming_playlist_sh_t *sh, u_char *md5) {
+    ngx_rbtree_node_t *node = sh->rbtree.root, *sentinel = sh->rbtree.sentinel;
+    ngx_rbtree_key_t key = ngx_crc32_short(md5, 16);
+    ngx_estreaming_playlist_node_t *pn;
+    ngx_int_t rc;
+
+    while (node != sentinel) {
+        if (key != node->key) {
+            node = key < node->key ? node->left : node->right;
+            continue;
+        }
+        pn = (ngx_estreaming_playlist_node_t *) node;
+        rc = ngx_memcmp(md5, pn->md5, 16);
+        if (rc == 0) return pn;
+        node = rc < 0 ? node->left : node->right;
+    }
+    return NULL;
+}
+
+/* NGX_OK: the cached playlist is in bucket, NGX_DECLINED: build it */
+static ngx_int_t ngx_estreaming_playlist_get(ngx_http_request_t *r, ngx_shm_zone_t *zone,
+        u_char *md5, bucket_t *bucket, u_char *etag, ngx_uint_t *segments) {
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t *) zone->shm.addr;
+    ngx_estreaming_playlist_sh_t *sh = zone->data;
+    ngx_estreaming_playlist_node_t *pn;
+    u_char *buf;
+    size_t len;
+
+    ngx_shmtx_lock(&shpool->mutex);
+    pn = ngx_estreaming_playlist_find(sh, md5);
+    if (pn == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_DECLINED;
+    }
+    ngx_queue_remove(&pn->queue);
+    ngx_queue_insert_head(&sh->queue, &pn->queue);
+    /* copied out, the entry may be evicted as soon as the lock is released */
+    len = pn->len;
+    buf = ngx_pnalloc(r->pool, len);
+    if (buf == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_ERROR;
+    }
+    ngx_memcpy(buf, pn->data, len);
+    ngx_memcpy(etag, pn->etag, 16);
+    *segments = pn->segments;
+    ngx_shmtx_unlock(&shpool->mutex);
+    bucket_append(bucket, buf, len);
+    return NGX_OK;
+}
+
+/* the least recently used entries make room for the new one */
+static void ngx_estreaming_playlist_put(ngx_shm_zone_t *zone, u_char *md5, u_char *etag,
+        bucket_t *bucket, ngx_uint_t segments) {
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t *) zone->shm.addr;
+    ngx_estreaming_playlist_sh_t *sh = zone->data;
+    ngx_estreaming_playlist_node_t *pn, *old;
+    ngx_queue_t *q;
+    ngx_buf_t *b;
+
+    if (bucket->first == NULL) return;
+    b = bucket->first->buf;
+    ngx_shmtx_lock(&shpool->mutex);
+    if (ngx_estreaming_playlist_find(sh, md5)) {
+        /* built by another worker meanwhile */
+        ngx_shmtx_unlock(&shpool->mutex);
+        return;
+    }
+    while ((pn = ngx_slab_alloc_locked(shpool, offsetof(ngx_estreaming_playlist_node_t, data)
+            + (b->last - b->pos))) == NULL) {
+        if (ngx_queue_empty(&sh->queue)) {
+            ngx_shmtx_unlock(&shpool->mutex);
+            return;
+        }
+        q = ngx_queue_last(&sh->queue);
+        old = ngx_queue_data(q, ngx_estreaming_playlist_node_t, queue);
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&sh->rbtree, &old->node);
+        ngx_slab_free_locked(shpool, old);
+    }
+    ngx_memcpy(pn->md5, md5, 16);
+    ngx_memcpy(pn->etag, etag, 16);
+    pn->segments = segments;
+    pn->len = b->last - b->pos;
+    ngx_memcpy(pn->data, b->pos, pn->len);
+    pn->node.key = ngx_crc32_short(md5, 16);
+    ngx_rbtree_insert(&sh->rbtree, &pn->node);
+    ngx_queue_insert_head(&sh->queue, &pn->queue);
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+/* the playlist is written to a single buffer by mp4_create_m3u8 */
+static void ngx_estreaming_playlist_etag(bucket_t *bucket, u_char *etag) {
+    ngx_md5_t md5;
+
+    ngx_md5_init(&md5);
+    if (bucket->first) {
+        ngx_md5_update(&md5, bucket->first->buf->pos,
+                bucket->first->buf->last - bucket->first->buf->pos);
+    }
+    ngx_md5_final(etag, &md5);
+}
+
+/*
+ * the playlist of a file never changes while the file does not, players and
+ * CDNs may keep it streaming_playlist_max_age, else they revalidate each time
+ */
+static ngx_int_t ngx_estreaming_playlist_headers(ngx_http_request_t *r, hls_conf_t *conf,
+        u_char *etag) {
+    ngx_table_elt_t *h;
+    u_char *p;
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) return NGX_ERROR;
+    h->value.data = ngx_pnalloc(r->pool, 2 * 16 + 2);
+    if (h->value.data == NULL) return NGX_ERROR;
+    h->hash = 1;
+    ngx_str_set(&h->key, "ETag");
+    p = h->value.data;
+    *p++ = '"';
+    p = ngx_hex_dump(p, etag, 16);
+    *p++ = '"';
+    h->value.len = p - h->value.data;
+    r->headers_out.etag = h;
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) return NGX_ERROR;
+    h->hash = 1;
+    ngx_str_set(&h->key, "Cache-Control");
+    if (conf->playlist_max_age == 0) {
+        ngx_str_set(&h->value, "no-cache");
+        return NGX_OK;
+    }
+    h->value.data = ngx_pnalloc(r->pool, sizeof ("max-age=") + NGX_TIME_T_LEN);
+    if (h->value.data == NULL) return NGX_ERROR;
+    h->value.len = ngx_sprintf(h->value.data, "max-age=%T", conf->playlist_max_age)
+            - h->value.data;
+    return NGX_OK;
+}
+
+// End Of File
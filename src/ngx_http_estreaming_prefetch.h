@@ -0,0 +1,400 @@
+/*
+ * File:   ngx_http_estreaming_prefetch.h
+ * Author:  - Hung Nguyen
+ *
+ * Speculative transcoding of the segments a player will ask for next.
+ * Serving adbr segment N queues N+1..N+streaming_prefetch of the same
+ * rendition; a worker timer transcodes them one at a time into the transcode
+ * cache, only while no client transcode is waiting for a slot. Jobs of a
+ * stream nobody asked for during streaming_prefetch_idle are dropped, as are
+ * jobs the player already reached by itself.
+ * The moov is parsed on the worker, the segment is built and transcoded as a
+ * task on the transcode threads so the event loop keeps serving meanwhile; the
+ * task writes to a pipe when it is done and the result is stored from there.
+ */
+
+#define NGX_ESTREAMING_PREFETCH_MAX 32
+#define NGX_ESTREAMING_PREFETCH_DELAY 100 /* ms, let client work go first */
+
+typedef struct {
+    ngx_str_t path; // source mp4
+    ngx_http_conf_ctx_t conf_ctx; // of the location which served the player
+    ngx_http_estreaming_rendition_t *rendition;
+    ngx_uint_t fragment_start;
+    ngx_uint_t length; // segment_length of the playlist the player follows
+    uint64_t clip_from; // msec, clipFrom/clipTo of that playlist
+    uint64_t clip_to;
+    ngx_msec_t last_seen; // last request of the stream
+    unsigned used : 1;
+    unsigned hevc : 1; // fMP4 variant of the rendition
+} ngx_estreaming_prefetch_job_t;
+
+/* the segment being transcoded, r is NULL when there is none */
+typedef struct {
+    adaptive_task_t task;
+    ngx_http_request_t *r;
+    ngx_fd_t fd;
+    mp4_context_t *mp4_context;
+    mp4_split_options_t *options;
+    video_buffer *destination;
+    ngx_str_t name; // in the transcode cache
+    uint64_t duration; // options->rate.duration, the speeds are measured here
+    int64_t elapsed; // usec
+    ngx_int_t rc;
+    unsigned started : 1; // the task was posted
+    volatile ngx_uint_t done; // set by the task last
+} ngx_estreaming_prefetch_task_t;
+
+static ngx_estreaming_prefetch_job_t ngx_estreaming_prefetch_jobs[NGX_ESTREAMING_PREFETCH_MAX];
+static ngx_estreaming_prefetch_task_t ngx_estreaming_prefetch_task;
+static ngx_event_t ngx_estreaming_prefetch_event;
+static ngx_fd_t ngx_estreaming_prefetch_notify[2] = { NGX_INVALID_FILE, NGX_INVALID_FILE };
+
+/* prefetching never runs unthrottled, the directive brings the counters */
+static char *ngx_estreaming_prefetch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    char *rv = ngx_conf_set_num_slot(cf, cmd, conf);
+    if (rv != NGX_CONF_OK) return rv;
+    return ngx_estreaming_admission_zone(cf);
+}
+
+static void ngx_estreaming_prefetch_free(ngx_estreaming_prefetch_job_t *job) {
+    if (job->path.data) ngx_free(job->path.data);
+    ngx_memzero(job, sizeof (ngx_estreaming_prefetch_job_t));
+}
+
+/*
+ * a request without a client for the location of the job, set up like
+ * ngx_http_alloc_request() does on a connection of its own
+ */
+static ngx_http_request_t *ngx_estreaming_prefetch_request(ngx_estreaming_prefetch_job_t *job) {
+    ngx_connection_t *c;
+    ngx_http_connection_t *hc;
+    ngx_http_request_t *r;
+    ngx_http_core_main_conf_t *cmcf;
+
+    c = ngx_get_connection((ngx_socket_t) -1, ngx_cycle->log);
+    if (c == NULL) return NULL;
+    c->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, c->log);
+    if (c->pool == NULL) goto failed;
+    hc = ngx_pcalloc(c->pool, sizeof (ngx_http_connection_t));
+    r = ngx_pcalloc(c->pool, sizeof (ngx_http_request_t));
+    if (hc == NULL || r == NULL) goto failed;
+    hc->conf_ctx = &job->conf_ctx;
+    c->data = hc;
+
+    r->pool = c->pool;
+    r->connection = c;
+    r->http_connection = hc;
+    r->main_conf = hc->conf_ctx->main_conf;
+    r->srv_conf = hc->conf_ctx->srv_conf;
+    r->loc_conf = hc->conf_ctx->loc_conf;
+    r->ctx = ngx_pcalloc(r->pool, sizeof (void *) * ngx_http_max_module);
+    if (r->ctx == NULL) goto failed;
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+    r->variables = ngx_pcalloc(r->pool, cmcf->variables.nelts
+            * sizeof (ngx_http_variable_value_t));
+    if (r->variables == NULL) goto failed;
+    if (ngx_list_init(&r->headers_in.headers, r->pool, 2, sizeof (ngx_table_elt_t)) != NGX_OK
+            || ngx_list_init(&r->headers_out.headers, r->pool, 2,
+            sizeof (ngx_table_elt_t)) != NGX_OK) goto failed;
+    r->headers_in.content_length_n = -1;
+    r->headers_in.keep_alive_n = -1;
+    r->headers_out.content_length_n = -1;
+    r->headers_out.last_modified_time = -1;
+    r->method = NGX_HTTP_GET;
+    r->main = r;
+    r->count = 1;
+    r->uri_changes = NGX_HTTP_MAX_URI_CHANGES + 1;
+    r->subrequests = NGX_HTTP_MAX_SUBREQUESTS + 1;
+    r->start_sec = ngx_time();
+    r->start_msec = ngx_current_msec;
+    return r;
+
+failed:
+    if (c->pool) ngx_destroy_pool(c->pool);
+    ngx_free_connection(c);
+    return NULL;
+}
+
+/* builds and transcodes the segment, touches nothing but the task */
+static void ngx_estreaming_prefetch_thread(void *data) {
+    ngx_estreaming_prefetch_task_t *task = data;
+    bucket_t *bucket = bucket_init(task->r);
+    int64_t started = av_gettime();
+    u_char c = 0;
+
+    task->rc = NGX_ERROR;
+    if (bucket && output_ts(task->mp4_context, bucket, task->options)) {
+        task->rc = ngx_estreaming_adaptive_bitrate(task->r, bucket->first, task->destination,
+                task->options);
+    }
+    task->elapsed = av_gettime() - started;
+    ngx_memory_barrier();
+    task->done = 1;
+    /* a full pipe already wakes the worker up */
+    (void) write(ngx_estreaming_prefetch_notify[1], &c, 1);
+}
+
+static void ngx_estreaming_prefetch_handler(ngx_event_t *ev);
+
+/* the read end of the pipe, picks up the finished segment */
+static void ngx_estreaming_prefetch_notified(ngx_event_t *ev) {
+    u_char buf[16];
+
+    while (read(ngx_estreaming_prefetch_notify[0], buf, sizeof (buf)) > 0) { /* drain */ }
+    if (ngx_estreaming_prefetch_event.timer_set) ngx_del_timer(&ngx_estreaming_prefetch_event);
+    ngx_estreaming_prefetch_handler(&ngx_estreaming_prefetch_event);
+}
+
+/* once per worker, on the first prefetch */
+static ngx_int_t ngx_estreaming_prefetch_pipe(ngx_log_t *log) {
+    ngx_fd_t *fd = ngx_estreaming_prefetch_notify;
+
+    if (fd[0] != NGX_INVALID_FILE) return NGX_OK;
+    if (pipe(fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "pipe() failed");
+        return NGX_ERROR;
+    }
+    if (ngx_nonblocking(fd[0]) == -1 || ngx_nonblocking(fd[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno, ngx_nonblocking_n " failed");
+        goto failed;
+    }
+    if (ngx_add_channel_event((ngx_cycle_t *) ngx_cycle, fd[0], NGX_READ_EVENT,
+            ngx_estreaming_prefetch_notified) != NGX_OK) goto failed;
+    return NGX_OK;
+
+failed:
+    close(fd[0]);
+    close(fd[1]);
+    fd[0] = fd[1] = NGX_INVALID_FILE;
+    return NGX_ERROR;
+}
+
+/* NGX_OK: the task is posted, NGX_DECLINED: nothing to do for the job */
+static ngx_int_t ngx_estreaming_prefetch_start(ngx_estreaming_prefetch_job_t *job) {
+    ngx_estreaming_prefetch_task_t *task = &ngx_estreaming_prefetch_task;
+    ngx_http_request_t *r;
+    ngx_file_t *file;
+    ngx_file_info_t fi;
+    mp4_split_options_t *options;
+    hls_conf_t *conf = job->conf_ctx.loc_conf[ngx_http_estreaming_module.ctx_index];
+
+    ngx_memzero(task, sizeof (ngx_estreaming_prefetch_task_t));
+    task->fd = NGX_INVALID_FILE;
+    r = ngx_estreaming_prefetch_request(job);
+    if (r == NULL) return NGX_ERROR;
+    task->r = r;
+    file = ngx_pcalloc(r->pool, sizeof (ngx_file_t));
+    task->destination = ngx_pcalloc(r->pool, sizeof (video_buffer));
+    if (file == NULL || task->destination == NULL) goto failed;
+    task->destination->pool = r->pool;
+
+    file->name = job->path;
+    file->log = r->connection->log;
+    task->fd = ngx_open_file(job->path.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (task->fd == NGX_INVALID_FILE) goto failed;
+    file->fd = task->fd;
+    if (ngx_fd_info(task->fd, &fi) == NGX_FILE_ERROR) goto failed;
+
+    options = mp4_split_options_init(r);
+    if (options == NULL) goto failed;
+    task->options = options;
+    options->adbr = 1;
+    options->fragments = 1;
+    options->fragment_start = job->fragment_start;
+    options->rendition = job->rendition;
+    options->hevc = job->hevc;
+    options->length = job->length;
+    options->clip_from = job->clip_from;
+    options->clip_to = job->clip_to;
+    if (ngx_estreaming_cache_name(r->pool, conf->transcode_cache, &job->path,
+            ngx_file_mtime(&fi), options, options->length, &task->name) != NGX_OK) goto failed;
+    if (ngx_estreaming_cache_exists(&task->name)) goto failed;
+
+    task->mp4_context = mp4_open(r, file, ngx_file_size(&fi), MP4_OPEN_MOOV);
+    if (task->mp4_context == NULL || moov_clip(task->mp4_context, options) != NGX_OK) goto failed;
+    ngx_estreaming_ladder_options(task->mp4_context, options);
+    ngx_estreaming_preset_select(task->mp4_context, options);
+    /* the speeds of the presets are per worker, updated back here */
+    task->duration = options->rate.duration;
+    options->rate.duration = 0;
+
+    /* one thread more than the GOPs need, the prefetch itself waits for them */
+    if (ngx_estreaming_prefetch_pipe(r->connection->log) != NGX_OK
+            || adaptive_threads_start(conf->transcode_threads + 1, r->connection->log) == 0)
+        goto failed;
+    task->task.handler = ngx_estreaming_prefetch_thread;
+    task->task.data = task;
+    task->started = 1;
+    adaptive_threads_post(&task->task);
+    return NGX_OK;
+
+failed:
+    task->done = 1;
+    return NGX_DECLINED;
+}
+
+/* after the task is done, or it was never posted */
+static void ngx_estreaming_prefetch_finish(ngx_estreaming_prefetch_task_t *task, ngx_uint_t store) {
+    ngx_http_request_t *r = task->r;
+    ngx_connection_t *c = r->connection;
+
+    if (task->started && task->rc == NGX_OK && store) {
+        task->options->rate.duration = task->duration;
+        ngx_estreaming_preset_done(r, task->options, task->elapsed);
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                "estreaming prefetched segment %ui of \"%V\"",
+                task->options->fragment_start, &task->name);
+        ngx_estreaming_cache_store(r->pool, &task->name, task->destination->first, c->log);
+    }
+    if (task->mp4_context) mp4_close(task->mp4_context);
+    if (task->fd != NGX_INVALID_FILE) ngx_close_file(task->fd);
+    ngx_destroy_pool(c->pool);
+    ngx_free_connection(c);
+    task->r = NULL;
+}
+
+static void ngx_estreaming_prefetch_handler(ngx_event_t *ev) {
+    ngx_uint_t i, pending = 0;
+    ngx_estreaming_prefetch_job_t *job, *next = NULL;
+    ngx_estreaming_prefetch_task_t *task = &ngx_estreaming_prefetch_task;
+    ngx_estreaming_shctx_t *sh;
+    hls_conf_t *conf;
+
+    if (task->r) {
+        /* the pipe calls back when the task is done */
+        if (!task->done) return;
+        ngx_memory_barrier();
+        ngx_estreaming_prefetch_finish(task, 1);
+        sh = ngx_estreaming_shm_zone->data;
+        ngx_atomic_fetch_add(&sh->active, -1);
+    }
+
+    for (i = 0; i < NGX_ESTREAMING_PREFETCH_MAX; i++) {
+        job = &ngx_estreaming_prefetch_jobs[i];
+        if (!job->used) continue;
+        conf = job->conf_ctx.loc_conf[ngx_http_estreaming_module.ctx_index];
+        if (ngx_exiting || ngx_estreaming_shm_zone == NULL
+                || ngx_current_msec - job->last_seen > conf->prefetch_idle) {
+            ngx_estreaming_prefetch_free(job);
+            continue;
+        }
+        pending++;
+        if (next == NULL || job->fragment_start < next->fragment_start) next = job;
+    }
+    if (next == NULL) return;
+
+    conf = next->conf_ctx.loc_conf[ngx_http_estreaming_module.ctx_index];
+    sh = ngx_estreaming_shm_zone->data;
+    /* players waiting for a transcode come first */
+    if (sh->queued || !ngx_estreaming_atomic_inc(&sh->active, conf->transcode_limit)) {
+        ngx_add_timer(ev, NGX_ESTREAMING_PREFETCH_DELAY);
+        return;
+    }
+    switch (ngx_estreaming_prefetch_start(next)) {
+        case NGX_OK:
+            pending++;
+            break;
+        case NGX_DECLINED:
+            ngx_estreaming_prefetch_finish(task, 0);
+            /* fall through */
+        default:
+            ngx_atomic_fetch_add(&sh->active, -1);
+    }
+    ngx_estreaming_prefetch_free(next);
+    if (pending > 1) ngx_add_timer(ev, NGX_ESTREAMING_PREFETCH_DELAY);
+}
+
+/* called for every adbr segment request, before the segment is built */
+static void ngx_estreaming_prefetch_schedule(ngx_http_request_t *r,
+        mp4_context_t *mp4_context, mp4_split_options_t const *options,
+        ngx_str_t *path, time_t mtime) {
+    hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_estreaming_module);
+    ngx_estreaming_prefetch_job_t *job, *slot;
+    ngx_uint_t i, k, start;
+    ngx_str_t name;
+    mp4_split_options_t ahead;
+
+    if (conf->prefetch == 0 || conf->transcode_cache == NULL || options->rendition == NULL
+            || options->init) return;
+
+    for (i = 0; i < NGX_ESTREAMING_PREFETCH_MAX; i++) {
+        job = &ngx_estreaming_prefetch_jobs[i];
+        if (!job->used || job->rendition != options->rendition || job->hevc != (unsigned) options->hevc
+                || job->length != options->length || job->clip_from != options->clip_from
+                || job->clip_to != options->clip_to || job->path.len != path->len
+                || ngx_strncmp(job->path.data, path->data, path->len) != 0) continue;
+        if (job->fragment_start <= (ngx_uint_t) options->fragment_start) {
+            ngx_estreaming_prefetch_free(job);
+        } else {
+            job->last_seen = ngx_current_msec;
+        }
+    }
+
+    ahead = *options;
+    start = options->fragment_start;
+    for (k = 0; k < conf->prefetch; k++) {
+        start = next_fragment_start(mp4_context, start, options->length);
+        if (start == 0) break;
+        slot = NULL;
+        for (i = 0; i < NGX_ESTREAMING_PREFETCH_MAX; i++) {
+            job = &ngx_estreaming_prefetch_jobs[i];
+            if (!job->used) {
+                if (slot == NULL) slot = job;
+                continue;
+            }
+            if (job->rendition == options->rendition && job->fragment_start == start
+                    && job->hevc == (unsigned) options->hevc && job->length == options->length
+                    && job->clip_from == options->clip_from && job->clip_to == options->clip_to
+                    && job->path.len == path->len
+                    && ngx_strncmp(job->path.data, path->data, path->len) == 0) break;
+        }
+        if (i < NGX_ESTREAMING_PREFETCH_MAX) continue; // already queued
+        if (slot == NULL) break;
+        ahead.fragment_start = start;
+        if (ngx_estreaming_cache_name(r->pool, conf->transcode_cache, path, mtime,
+                &ahead, ahead.length, &name) != NGX_OK) break;
+        if (ngx_estreaming_cache_exists(&name)) continue;
+
+        slot->path.data = ngx_alloc(path->len + 1, r->connection->log);
+        if (slot->path.data == NULL) break;
+        ngx_memcpy(slot->path.data, path->data, path->len);
+        slot->path.data[path->len] = '\0';
+        slot->path.len = path->len;
+        slot->conf_ctx.main_conf = r->main_conf;
+        slot->conf_ctx.srv_conf = r->srv_conf;
+        slot->conf_ctx.loc_conf = r->loc_conf;
+        slot->rendition = options->rendition;
+        slot->hevc = options->hevc;
+        slot->fragment_start = start;
+        slot->length = options->length;
+        slot->clip_from = options->clip_from;
+        slot->clip_to = options->clip_to;
+        slot->last_seen = ngx_current_msec;
+        slot->used = 1;
+    }
+
+    if (!ngx_estreaming_prefetch_event.timer_set) {
+        ngx_estreaming_prefetch_event.handler = ngx_estreaming_prefetch_handler;
+        ngx_estreaming_prefetch_event.log = ngx_cycle->log;
+        ngx_add_timer(&ngx_estreaming_prefetch_event, NGX_ESTREAMING_PREFETCH_DELAY);
+    }
+}
+
+static void ngx_estreaming_prefetch_cleanup(void) {
+    ngx_uint_t i;
+
+    /* waits for the segment being transcoded, nothing is stored anymore */
+    if (ngx_estreaming_prefetch_task.r) {
+        while (!ngx_estreaming_prefetch_task.done) ngx_msleep(10);
+        ngx_memory_barrier();
+        ngx_estreaming_prefetch_finish(&ngx_estreaming_prefetch_task, 0);
+    }
+    for (i = 0; i < NGX_ESTREAMING_PREFETCH_MAX; i++) {
+        if (ngx_estreaming_prefetch_jobs[i].used) {
+            ngx_estreaming_prefetch_free(&ngx_estreaming_prefetch_jobs[i]);
+        }
+    }
+}
+
+// End Of File
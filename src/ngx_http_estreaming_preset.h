@@ -0,0 +1,142 @@
+/*
+ * File:   ngx_http_estreaming_preset.h
+ * Author:  - Hung Nguyen
+ *
+ * Deadline-aware x264 preset selection.
+ * Every worker keeps the encode speed of each rendition, codec and preset, as
+ * seconds of media per second of transcode, normalized to a single running
+ * transcode. With streaming_transcode_deadline set, a segment gets the
+ * slowest preset, up to the one of its rendition, expected to finish within
+ * that share of its duration under the current number of transcodes.
+ */
+
+#define NGX_ESTREAMING_SPEED_MAX 32
+/* weight of the last segment in the speed average, percent */
+#define NGX_ESTREAMING_SPEED_WEIGHT 30
+
+/* rough x264 speed of each preset relative to medium, until one is measured */
+static double const ngx_estreaming_preset_factor[NGX_ESTREAMING_PRESETS] = {
+    6.0, 4.5, 3.0, 1.8, 1.3, 1.0, 0.65, 0.3, 0.15
+};
+
+typedef struct {
+    void const *rendition;
+    ngx_flag_t hevc; // x265 and x264 speeds differ a lot
+    double speed[NGX_ESTREAMING_PRESETS]; // 0 = never measured
+} ngx_estreaming_speed_t;
+
+static ngx_estreaming_speed_t ngx_estreaming_speeds[NGX_ESTREAMING_SPEED_MAX];
+
+static char *ngx_estreaming_transcode_deadline(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    char *rv = ngx_conf_set_num_slot(cf, cmd, conf);
+    if (rv != NGX_CONF_OK) return rv;
+    if (((hls_conf_t *) conf)->deadline > 100) return "must not be more than 100";
+    return ngx_estreaming_admission_zone(cf);
+}
+
+static ngx_int_t ngx_estreaming_preset_index(ngx_str_t const *name) {
+    ngx_int_t i;
+    for (i = 0; i < NGX_ESTREAMING_PRESETS; i++) {
+        if (ngx_estreaming_preset_names[i].len == name->len
+                && ngx_strncmp(ngx_estreaming_preset_names[i].data, name->data, name->len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static ngx_estreaming_speed_t *ngx_estreaming_speed_find(void const *rendition, ngx_flag_t hevc,
+        ngx_uint_t add) {
+    ngx_uint_t i;
+    for (i = 0; i < NGX_ESTREAMING_SPEED_MAX; i++) {
+        if (ngx_estreaming_speeds[i].rendition == rendition
+                && ngx_estreaming_speeds[i].hevc == hevc) return &ngx_estreaming_speeds[i];
+        if (ngx_estreaming_speeds[i].rendition == NULL) {
+            if (!add) return NULL;
+            ngx_estreaming_speeds[i].rendition = rendition;
+            ngx_estreaming_speeds[i].hevc = hevc;
+            return &ngx_estreaming_speeds[i];
+        }
+    }
+    return NULL;
+}
+
+/* measured speed of the preset, else derived from the closest measured one */
+static double ngx_estreaming_speed_of(ngx_estreaming_speed_t const *speed, ngx_int_t preset) {
+    ngx_int_t d;
+    for (d = 0; d < NGX_ESTREAMING_PRESETS; d++) {
+        if (preset - d >= 0 && speed->speed[preset - d] > 0)
+            return speed->speed[preset - d] * ngx_estreaming_preset_factor[preset]
+                    / ngx_estreaming_preset_factor[preset - d];
+        if (preset + d < NGX_ESTREAMING_PRESETS && speed->speed[preset + d] > 0)
+            return speed->speed[preset + d] * ngx_estreaming_preset_factor[preset]
+                    / ngx_estreaming_preset_factor[preset + d];
+    }
+    return 0;
+}
+
+/* msec of the segment starting at the fragment_start keyframe, 0 = unknown */
+static ngx_msec_t ngx_estreaming_segment_duration(struct mp4_context_t *mp4_context,
+        u_int fragment_start, u_int seconds) {
+    trak_t const *trak;
+    moov_segment_t segment;
+
+    if (!moov_build_index(mp4_context, mp4_context->moov)) return 0;
+    trak = moov_segment_trak(mp4_context->moov);
+    if (trak == NULL || !trak->mdia_->mdhd_->timescale_
+            || !moov_segment_at(trak, seconds, fragment_start, &segment)) return 0;
+    return segment.duration * 1000 / trak->mdia_->mdhd_->timescale_;
+}
+
+/* before output_ts, which rewrites the timestamps of the segment */
+static void ngx_estreaming_preset_select(struct mp4_context_t *mp4_context,
+        mp4_split_options_t *options) {
+    hls_conf_t *conf = ngx_http_get_module_loc_conf(mp4_context->r, ngx_http_estreaming_module);
+    ngx_estreaming_shctx_t *sh = ngx_estreaming_shm_zone ? ngx_estreaming_shm_zone->data : NULL;
+    ngx_estreaming_speed_t *speed;
+    ngx_int_t preset, max;
+    double need, load;
+
+    options->rate.preset = -1;
+    if (conf->deadline == 0 || options->rendition == NULL) return;
+    max = ngx_estreaming_preset_index(&options->rendition->preset);
+    if (max < 0) return;
+    options->rate.duration = ngx_estreaming_segment_duration(mp4_context,
+            options->fragment_start, options->length);
+
+    preset = max;
+    speed = ngx_estreaming_speed_find(options->rendition, options->rate.hevc, 0);
+    if (speed && options->rate.duration) {
+        /* this request holds one of the active transcodes already */
+        load = sh && sh->active > 1 ? (double) sh->active : 1.0;
+        need = 100.0 / conf->deadline;
+        while (preset > 0 && ngx_estreaming_speed_of(speed, preset) / load < need) preset--;
+    }
+    options->rate.preset = preset;
+    if (sh) ngx_atomic_fetch_add(&sh->presets[preset], 1);
+}
+
+/* after the transcode of a segment, elapsed in usec */
+static void ngx_estreaming_preset_done(ngx_http_request_t *r,
+        mp4_split_options_t const *options, int64_t elapsed) {
+    hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_estreaming_module);
+    ngx_estreaming_shctx_t *sh = ngx_estreaming_shm_zone ? ngx_estreaming_shm_zone->data : NULL;
+    ngx_estreaming_speed_t *speed;
+    ngx_int_t preset = options->rate.preset;
+    double measured, *avg;
+
+    if (preset < 0 || options->rate.duration == 0 || elapsed <= 0) return;
+    if (sh && elapsed / 1000 > (int64_t) (options->rate.duration * conf->deadline / 100))
+        ngx_atomic_fetch_add(&sh->late, 1);
+    speed = ngx_estreaming_speed_find(options->rendition, options->rate.hevc, 1);
+    if (speed == NULL) return;
+    measured = options->rate.duration * 1000.0 / elapsed;
+    if (sh && sh->active > 1) measured *= sh->active;
+    avg = &speed->speed[preset];
+    *avg = *avg > 0 ? (*avg * (100 - NGX_ESTREAMING_SPEED_WEIGHT)
+            + measured * NGX_ESTREAMING_SPEED_WEIGHT) / 100 : measured;
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "estreaming %V preset %V speed %.2f", &options->rendition->name,
+            &ngx_estreaming_preset_names[preset], measured);
+}
+
+// End Of File
@@ -0,0 +1,280 @@
+/*
+ * File:   ngx_http_estreaming_sequence.h
+ * Author:  - Hung Nguyen
+ *
+ * Sequences: one media playlist over several mp4s.
+ * A request for show.m3u8 without a show.mp4 next to it reads show.json:
+ *
+ *     {"clips": [{"path": "bumpers/intro.mp4"},
+ *                {"path": "episode.mp4", "clipFrom": 0, "clipTo": 600000}]}
+ *
+ * Each clip is segmented from its own index, clipFrom/clipTo cut it like the
+ * arguments of the same name, and an EXT-X-DISCONTINUITY separates clips.
+ * Segment URLs are the org segments of each mp4, relative to the sequence,
+ * so segments are served and cached as if the mp4 was played alone.
+ */
+
+#define NGX_ESTREAMING_SEQUENCE_CLIPS 64
+#define NGX_ESTREAMING_SEQUENCE_SIZE 65536 // of the json file
+
+typedef struct {
+    ngx_str_t path; // relative to the sequence, as written in it
+    uint64_t clip_from; // msec
+    uint64_t clip_to;
+    mp4_context_t *mp4_context;
+    trak_t const *trak; // segmented one, see moov_segment_trak
+    ngx_str_t args; // clipFrom/clipTo of its segment URLs
+} ngx_estreaming_clip_t;
+
+static u_char *ngx_estreaming_json_space(u_char *p, u_char *last) {
+    while (p < last && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    return p;
+}
+
+/* a string without escapes, p on its opening quote */
+static u_char *ngx_estreaming_json_string(u_char *p, u_char *last, ngx_str_t *s) {
+    u_char *q;
+
+    if (p == last || *p != '"') return NULL;
+    for (q = ++p; q < last && *q != '"'; q++) {
+        if (*q == '\\') return NULL;
+    }
+    if (q == last) return NULL;
+    s->data = p;
+    s->len = q - p;
+    return q + 1;
+}
+
+static u_char *ngx_estreaming_json_number(u_char *p, u_char *last, uint64_t *v) {
+    u_char *start = p;
+    for (*v = 0; p < last && *p >= '0' && *p <= '9'; p++) *v = *v * 10 + (*p - '0');
+    return p == start ? NULL : p;
+}
+
+/* the layout above and nothing else, a path is an mp4 below the sequence */
+static ngx_int_t ngx_estreaming_sequence_parse(u_char *p, u_char *last,
+        ngx_estreaming_clip_t *clips, ngx_uint_t *n) {
+    ngx_estreaming_clip_t *clip;
+    ngx_str_t key;
+    u_char *c, *end;
+
+    *n = 0;
+    p = ngx_estreaming_json_space(p, last);
+    if (p == last || *p != '{') return NGX_ERROR;
+    p = ngx_estreaming_json_string(ngx_estreaming_json_space(p + 1, last), last, &key);
+    if (p == NULL || !mp4_arg_is(key.data, key.len, "clips")) return NGX_ERROR;
+    p = ngx_estreaming_json_space(p, last);
+    if (p == last || *p != ':') return NGX_ERROR;
+    p = ngx_estreaming_json_space(p + 1, last);
+    if (p == last || *p != '[') return NGX_ERROR;
+    p = ngx_estreaming_json_space(p + 1, last);
+
+    while (p < last && *p != ']') {
+        if (*p != '{' || *n == NGX_ESTREAMING_SEQUENCE_CLIPS) return NGX_ERROR;
+        clip = &clips[(*n)++];
+        ngx_memzero(clip, sizeof (ngx_estreaming_clip_t));
+        p = ngx_estreaming_json_space(p + 1, last);
+        while (p < last && *p != '}') {
+            p = ngx_estreaming_json_string(p, last, &key);
+            if (p == NULL) return NGX_ERROR;
+            p = ngx_estreaming_json_space(p, last);
+            if (p == last || *p != ':') return NGX_ERROR;
+            p = ngx_estreaming_json_space(p + 1, last);
+            if (mp4_arg_is(key.data, key.len, "path")) {
+                p = ngx_estreaming_json_string(p, last, &clip->path);
+            } else if (mp4_arg_is(key.data, key.len, "clipFrom")) {
+                p = ngx_estreaming_json_number(p, last, &clip->clip_from);
+            } else if (mp4_arg_is(key.data, key.len, "clipTo")) {
+                p = ngx_estreaming_json_number(p, last, &clip->clip_to);
+            } else {
+                return NGX_ERROR;
+            }
+            if (p == NULL) return NGX_ERROR;
+            p = ngx_estreaming_json_space(p, last);
+            if (p < last && *p == ',') p = ngx_estreaming_json_space(p + 1, last);
+        }
+        if (p == last) return NGX_ERROR;
+
+        /* relative, no .. component, ends with .mp4 */
+        end = clip->path.data + clip->path.len;
+        if (clip->path.len <= 4 || clip->path.data[0] == '/'
+                || ngx_strncmp(end - 4, ".mp4", 4) != 0) return NGX_ERROR;
+        for (c = clip->path.data; c < end; c++) {
+            if (c[0] == '.' && c + 1 < end && c[1] == '.' && (c == clip->path.data || c[-1] == '/')
+                    && (c + 2 == end || c[2] == '/')) return NGX_ERROR;
+        }
+        p = ngx_estreaming_json_space(p + 1, last);
+        if (p < last && *p == ',') p = ngx_estreaming_json_space(p + 1, last);
+    }
+    return p < last && *n ? NGX_OK : NGX_ERROR;
+}
+
+/* the json next to the mp4 path, NGX_DECLINED when there is none */
+static ngx_int_t ngx_estreaming_sequence_read(ngx_http_request_t *r, ngx_str_t *name,
+        ngx_str_t *json, time_t *mtime) {
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_open_file_info_t of;
+    ngx_file_t file;
+    ssize_t n;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    ngx_memzero(&of, sizeof (ngx_open_file_info_t));
+    of.read_ahead = clcf->read_ahead;
+    of.directio = NGX_MAX_OFF_T_VALUE;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+    if (ngx_open_cached_file(clcf->open_file_cache, name, &of, r->pool) != NGX_OK) {
+        return of.err == NGX_ENOENT || of.err == NGX_ENOTDIR ? NGX_DECLINED : NGX_ERROR;
+    }
+    if (!of.is_file) return NGX_DECLINED;
+    if (of.size == 0 || of.size > NGX_ESTREAMING_SEQUENCE_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "sequence \"%V\" is empty or larger than %d", name, NGX_ESTREAMING_SEQUENCE_SIZE);
+        return NGX_ERROR;
+    }
+    json->data = ngx_pnalloc(r->pool, (size_t) of.size);
+    if (json->data == NULL) return NGX_ERROR;
+    ngx_memzero(&file, sizeof (ngx_file_t));
+    file.fd = of.fd;
+    file.name = *name;
+    file.log = r->connection->log;
+    n = ngx_read_file(&file, json->data, (size_t) of.size, 0);
+    if (n != (ssize_t) of.size) return NGX_ERROR;
+    json->len = n;
+    *mtime = of.mtime;
+    return NGX_OK;
+}
+
+/*
+ * media playlist of the sequence replacing the mp4 at path.
+ * NGX_DECLINED: there is no sequence either, else an HTTP status on failure
+ */
+static ngx_int_t ngx_estreaming_sequence(ngx_http_request_t *r,
+        mp4_split_options_t const *options, ngx_str_t const *path, struct bucket_t *bucket,
+        time_t *mtime, ngx_uint_t *segments) {
+    hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_estreaming_module);
+    ngx_estreaming_clip_t clips[NGX_ESTREAMING_SEQUENCE_CLIPS], *clip;
+    mp4_split_options_t window;
+    moov_segment_t segment;
+    ngx_str_t name, json, file, query, dir, base, prefix = ngx_null_string;
+    ngx_uint_t i, n = 0, target = 1, t;
+    ngx_int_t rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    size_t size, line;
+    u_char *buffer, *p, *dot, *slash;
+
+    *segments = 0;
+    /* <dir>/<name>.mp4 -> <dir>/<name>.json */
+    for (dot = path->data + path->len; dot > path->data && *dot != '.'; dot--) { /* void */ }
+    name.len = (dot - path->data) + sizeof (".json") - 1;
+    name.data = ngx_pnalloc(r->pool, name.len + 1);
+    if (name.data == NULL) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    ngx_memcpy(ngx_cpymem(name.data, path->data, dot - path->data), ".json", sizeof (".json"));
+
+    switch (ngx_estreaming_sequence_read(r, &name, &json, mtime)) {
+        case NGX_OK:
+            break;
+        case NGX_DECLINED:
+            return NGX_DECLINED;
+        default:
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    /* its clips are in the file, the request cannot cut them */
+    if (options->clip_from || options->clip_to) return NGX_HTTP_BAD_REQUEST;
+    if (ngx_estreaming_sequence_parse(json.data, json.data + json.len, clips, &n) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "invalid sequence \"%V\"", &name);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    if (m3u8_query(r->pool, &r->args, 1, &query) != NGX_OK) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    /* absolute with hls_relative off, like the URLs of mp4_create_m3u8 */
+    if (!conf->relative) {
+        for (slash = r->uri.data + r->uri.len; slash > r->uri.data && slash[-1] != '/'; slash--) {
+            /* void */
+        }
+        prefix.len = sizeof ("http://") - 1 + r->headers_in.server.len + (slash - r->uri.data);
+        prefix.data = ngx_pnalloc(r->pool, prefix.len);
+        if (prefix.data == NULL) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        p = ngx_cpymem(prefix.data, "http://", sizeof ("http://") - 1);
+        p = ngx_cpymem(p, r->headers_in.server.data, r->headers_in.server.len);
+        ngx_memcpy(p, r->uri.data, slash - r->uri.data);
+    }
+
+    for (slash = name.data + name.len; slash > name.data && slash[-1] != '/'; slash--) { /* void */ }
+    size = 3 * M3U8_LINE_MAX;
+    for (i = 0; i < n; i++) {
+        clip = &clips[i];
+        file.len = (slash - name.data) + clip->path.len;
+        file.data = ngx_pnalloc(r->pool, file.len + 1);
+        if (file.data == NULL) goto done;
+        p = ngx_cpymem(ngx_cpymem(file.data, name.data, slash - name.data),
+                clip->path.data, clip->path.len);
+        *p = '\0';
+        clip->mp4_context = ngx_estreaming_variant_open(r, &file);
+        if (clip->mp4_context == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "\"%V\" of sequence \"%V\" can not be opened", &file, &name);
+            rc = NGX_HTTP_NOT_FOUND;
+            goto done;
+        }
+        window = *options;
+        window.clip_from = clip->clip_from;
+        window.clip_to = clip->clip_to;
+        if (moov_clip(clip->mp4_context, &window) != NGX_OK
+                || (clip->trak = moov_segment_trak(clip->mp4_context->moov)) == NULL
+                || !clip->trak->mdia_->mdhd_->timescale_) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "\"%V\" of sequence \"%V\" has no video to segment", &file, &name);
+            goto done;
+        }
+        if (clip->clip_from || clip->clip_to) {
+            clip->args.data = ngx_pnalloc(r->pool, sizeof ("&clipFrom=&clipTo=") + 2 * NGX_INT64_LEN);
+            if (clip->args.data == NULL) goto done;
+            clip->args.len = ngx_sprintf(clip->args.data, "%cclipFrom=%uL&clipTo=%uL",
+                    query.len ? '&' : '?', clip->clip_from, clip->clip_to) - clip->args.data;
+        }
+        line = M3U8_LINE_MAX + prefix.len + clip->path.len + NGX_INT32_LEN + query.len + clip->args.len;
+        size += sizeof ("#EXT-X-DISCONTINUITY\n");
+        segment.last = NULL;
+        while (moov_segment_next(clip->trak, options->length, &segment)) {
+            t = moov_target_duration(clip->trak, segment.duration);
+            if (t > target) target = t;
+            size += line;
+            (*segments)++;
+        }
+    }
+
+    buffer = ngx_pnalloc(r->pool, size);
+    if (buffer == NULL) goto done;
+    p = ngx_sprintf(buffer, "#EXTM3U\n#EXT-X-TARGETDURATION:%ui\n#EXT-X-MEDIA-SEQUENCE:0\n"
+            "#EXT-X-VERSION:4\n", target);
+    for (i = 0; i < n; i++) {
+        clip = &clips[i];
+        /* <dir/><segment>/<base>.ts, the URL layout of mp4_split_options_uri */
+        for (dir.data = clip->path.data + clip->path.len; dir.data > clip->path.data
+                && dir.data[-1] != '/'; dir.data--) { /* void */ }
+        base.data = dir.data;
+        base.len = clip->path.len - (base.data - clip->path.data) - (sizeof (".mp4") - 1);
+        dir.len = dir.data - clip->path.data;
+        dir.data = clip->path.data;
+        if (i) p = ngx_sprintf(p, "#EXT-X-DISCONTINUITY\n");
+        segment.last = NULL;
+        while (moov_segment_next(clip->trak, options->length, &segment)) {
+            p = ngx_sprintf(p, "#EXTINF:%.3f,\n%V%V%uD/%V.ts%V%V\n",
+                    (double) segment.duration / clip->trak->mdia_->mdhd_->timescale_,
+                    &prefix, &dir, segment.start, &base, &query, &clip->args);
+        }
+    }
+    p = ngx_sprintf(p, "#EXT-X-ENDLIST\n");
+    bucket_append(bucket, buffer, p - buffer);
+    rc = NGX_OK;
+
+done:
+    for (i = 0; i < n; i++) {
+        if (clips[i].mp4_context) mp4_close(clips[i].mp4_context);
+    }
+    return rc;
+}
+
+// End Of File
@@ -0,0 +1,57 @@
+/*
+ * File:   ngx_http_estreaming_variant.h
+ * Author:  - Hung Nguyen
+ *
+ * Pre-encoded renditions.
+ * With streaming_preencoded on, a rung of demo.mp4 is first looked up as
+ * demo_<rendition>.mp4 in the same directory. When that file exists and its
+ * media playlist cuts at the same times as the one of demo.mp4, the master
+ * playlist lists it as org/<rendition>/ with the resolution, bitrate and
+ * codecs of its own moov, and its segments are only remuxed like the org
+ * ones. Rungs without such a file are transcoded as before.
+ */
+
+/* <dir>/<name>_<rendition>.mp4 for <dir>/<name>.mp4 */
+static ngx_int_t ngx_estreaming_variant_path(ngx_pool_t *pool, ngx_str_t const *path,
+        ngx_str_t const *rendition, ngx_str_t *variant) {
+    u_char *dot = path->data + path->len, *p;
+
+    while (dot > path->data && *dot != '.') dot--;
+    variant->len = path->len + 1 + rendition->len;
+    variant->data = ngx_pnalloc(pool, variant->len + 1);
+    if (variant->data == NULL) return NGX_ERROR;
+    p = ngx_cpymem(variant->data, path->data, dot - path->data);
+    *p++ = '_';
+    p = ngx_cpymem(p, rendition->data, rendition->len);
+    p = ngx_cpymem(p, dot, path->data + path->len - dot);
+    *p = '\0';
+    return NGX_OK;
+}
+
+/* the moov of a variant through the open file cache, NULL when there is none */
+static mp4_context_t *ngx_estreaming_variant_open(ngx_http_request_t *r, ngx_str_t *path) {
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_open_file_info_t of;
+    ngx_file_t *file;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    ngx_memzero(&of, sizeof (ngx_open_file_info_t));
+    of.read_ahead = clcf->read_ahead;
+    of.directio = NGX_MAX_OFF_T_VALUE;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+    if (ngx_open_cached_file(clcf->open_file_cache, path, &of, r->pool) != NGX_OK
+            || !of.is_file) {
+        return NULL;
+    }
+    file = ngx_pcalloc(r->pool, sizeof (ngx_file_t));
+    if (file == NULL) return NULL;
+    file->fd = of.fd;
+    file->name = *path;
+    file->log = r->connection->log;
+    return mp4_open(r, file, of.size, MP4_OPEN_MOOV);
+}
+
+// End Of File
@@ -50,4 +50,29 @@ extern void bucket_insert(bucket_t *bucket, void const *buf, uint64_t size) {
   bucket->content_length += size;
 }
 
+/* like bucket_insert, for a buffer of the request pool sent without a copy */
+extern void bucket_append(bucket_t *bucket, u_char *buf, uint64_t size) {
+  ngx_buf_t *b = ngx_pcalloc(bucket->r->pool, sizeof(ngx_buf_t));
+  if(b == NULL) return;
+
+  if(bucket->first != 0) {
+    (*bucket->chain)->buf->last_buf = 0;
+    (*bucket->chain)->buf->last_in_chain = 0;
+    bucket->chain = &(*bucket->chain)->next;
+  }
+  *bucket->chain = ngx_pcalloc(bucket->r->pool, sizeof(ngx_chain_t));
+  if(*bucket->chain == NULL) return;
+
+  b->pos = buf;
+  b->last = buf + size;
+  b->memory = 1;
+  b->last_buf = 1;
+  b->last_in_chain = 1;
+
+  (*bucket->chain)->buf = b;
+  (*bucket->chain)->next = NULL;
+
+  bucket->content_length += size;
+}
+
 // End Of File
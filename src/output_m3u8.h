@@ -10,236 +10,459 @@
  * is almost faster, we should use all of its functions
  ******************************************************************************/
 
-#define R_360P 1
-#define R_480P 2
-#define R_720P 3
-
-void replace(char * o_string, char * s_string, char * r_string) {
-    //a buffer variable to do all replace things
-    // we use extra[max=100], we should use safe buffer size here
-    char buffer[100];
-    //to store the pointer returned from strstr
-    char * ch;
-
-    //first exit condition
-    if (!(ch = strstr(o_string, s_string)))
-        return;
-
-    //copy all the content to buffer before the first occurrence of the search string
-    strncpy(buffer, o_string, ch - o_string);
-
-    //prepare the buffer for appending by adding a null to the end of it
-    buffer[ch - o_string] = 0;
-
-    //append using sprintf function
-    sprintf(buffer + (ch - o_string), "%s%s", r_string, ch + strlen(s_string));
-
-    //empty o_string for copying
-    o_string[0] = 0;
-    strcpy(o_string, buffer);
-    //pass recursively to replace other occurrences
-    return replace(o_string, s_string, r_string);
+/* a playlist line without its URL, CODECS included, is never longer */
+#define M3U8_LINE_MAX 256
+
+/*
+ * query string handed on to the URLs of a playlist. media playlists drop what
+ * their path says already: adbr, org, vr and codec
+ */
+static ngx_int_t m3u8_query(ngx_pool_t *pool, ngx_str_t const *args, ngx_uint_t media,
+        ngx_str_t *query) {
+    u_char *p, *param, *end, *amp;
+    size_t len;
+
+    query->len = 0;
+    query->data = NULL;
+    if (args->len == 0) return NGX_OK;
+    query->data = ngx_pnalloc(pool, args->len + 1);
+    if (query->data == NULL) return NGX_ERROR;
+    p = query->data;
+    end = args->data + args->len;
+    for (param = args->data; param < end; param = amp + 1) {
+        amp = ngx_strlchr(param, end, '&');
+        if (amp == NULL) amp = end;
+        len = amp - param;
+        if (len == 0) continue;
+        if (media && ((len >= 5 && ngx_strncmp(param, "adbr=", 5) == 0)
+                || (len >= 4 && ngx_strncmp(param, "org=", 4) == 0)
+                || (len >= 3 && ngx_strncmp(param, "vr=", 3) == 0)
+                || (len >= 6 && ngx_strncmp(param, "codec=", 6) == 0))) continue;
+        *p = p == query->data ? '?' : '&';
+        p++;
+        p = ngx_cpymem(p, param, len);
+    }
+    query->len = p - query->data;
+    return NGX_OK;
 }
 
-int mp4_create_m3u8(struct mp4_context_t *mp4_context, struct bucket_t * bucket,
-        struct mp4_split_options_t *options, int width, ngx_str_t path) {
-    hls_conf_t *conf = ngx_http_get_module_loc_conf(mp4_context->r, ngx_http_estreaming_module);
-    int result = 0;
-    u_char *buffer = NULL;
-    buffer = (u_char *) ngx_palloc(mp4_context->r->pool, 1024 * 256);
-    u_char *p = buffer;
-    char extra[100] = "";
-    if (mp4_context->r->args.data) {
-        extra[0] = '?';
-        strncpy(extra + 1, (const char *) mp4_context->r->args.data, mp4_context->r->args.len < 100 ? mp4_context->r->args.len : 100);
-    }
-
-    /* #EXTM3U
-    #EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=1280000,RESOLUTION=640x360
-    http://221.132.35.210:9090/vod/hai.m3u8?adbr=true&vr=360p
-    #EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=2560000,RESOLUTION=854x480
-    http://221.132.35.210:9090/vod/hai.m3u8?adbr=true&vr=480p
-    #EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=7680000, RESOLUTION=1080x720
-    hhttp://221.132.35.210:9090/vod/hai.m3u8
-     */
-    char *rewrite = NULL;
-    p = ngx_sprintf(p, "#EXTM3U\n");
-    if (conf->hls_proxy.data != NULL) {
-        rewrite = (char *) ngx_palloc(mp4_context->r->pool,
-                ngx_strlen(conf->hls_proxy.data) + ngx_strlen(mp4_context->file->name.data) +
-                ngx_strlen(mp4_context->r->headers_in.server.data) - mp4_context->root + 7);
-    }
-    char *filename = NULL;
-    if (!conf->relative) {
-        filename = (char *) ngx_palloc(mp4_context->r->pool, ngx_strlen(mp4_context->file->name.data) + ngx_strlen(mp4_context->r->headers_in.server.data) - mp4_context->root + 7);
-        strcpy(filename, "http://");
-        strcat(filename, (const char *) (mp4_context->r->headers_in.server.data));
-        strcat(filename, (const char *) (mp4_context->file->name.data + mp4_context->root));
+/* first sample entry of the first track of that kind */
+static sample_entry_t const *m3u8_sample_entry(moov_t const *moov, uint32_t handler_type) {
+    stsd_t const *stsd;
+    unsigned int track_id;
+
+    for (track_id = 0; track_id < moov->tracks_; ++track_id) {
+        if (moov->traks_[track_id]->mdia_->hdlr_->handler_type_ != handler_type) continue;
+        stsd = moov->traks_[track_id]->mdia_->minf_->stbl_->stsd_;
+        return stsd && stsd->entries_ ? stsd->sample_entries_ : NULL;
+    }
+    return NULL;
+}
+
+/* avc1.PPCCLL with profile_idc, constraint flags and level_idc of the avcC */
+static u_char *m3u8_source_video_codec(moov_t const *moov, u_char *p) {
+    sample_entry_t const *entry = m3u8_sample_entry(moov, FOURCC('v', 'i', 'd', 'e'));
+    unsigned char const *avcc;
+
+    if (entry == NULL || entry->codec_private_data_length_ < 4
+            || (entry->fourcc_ != FOURCC('a', 'v', 'c', '1')
+            && entry->fourcc_ != FOURCC('a', 'v', 'c', '3'))) {
+        return ngx_sprintf(p, "avc1.4d4015");
+    }
+    avcc = entry->codec_private_data_;
+    return ngx_sprintf(p, "%s.%02xd%02xd%02xd",
+            entry->fourcc_ == FOURCC('a', 'v', 'c', '3') ? "avc3" : "avc1",
+            (int) avcc[1], (int) avcc[2], (int) avcc[3]);
+}
+
+/*
+ * mp4a.40.<audio object type> from the AudioSpecificConfig of the esds,
+ * mp4a.<object type> for MPEG-2 and mp3 tracks, nothing without audio
+ */
+static u_char *m3u8_source_audio_codec(moov_t const *moov, u_char *p) {
+    sample_entry_t const *entry = m3u8_sample_entry(moov, FOURCC('s', 'o', 'u', 'n'));
+    unsigned char const *asc;
+    unsigned int aot;
+
+    if (entry == NULL) return p;
+    if (entry->object_type_id_ == MP4_MPEG4Audio && entry->codec_private_data_length_ >= 2) {
+        asc = entry->codec_private_data_;
+        aot = asc[0] >> 3;
+        if (aot == 31) aot = 32 + (((asc[0] & 7) << 3) | (asc[1] >> 5));
+        return ngx_sprintf(p, ",mp4a.40.%ui", (ngx_uint_t) aot);
+    }
+    if (entry->object_type_id_ && entry->object_type_id_ != MP4_MPEG4Audio) {
+        return ngx_sprintf(p, ",mp4a.%02xd", (int) entry->object_type_id_);
+    }
+    return ngx_sprintf(p, ",mp4a.40.2");
+}
+
+/* the profile and level x264 is configured with, constraint flags as x264 sets them */
+static u_char *m3u8_rung_video_codec(ngx_http_estreaming_rendition_t const *rendition, u_char *p) {
+    ngx_uint_t profile = 0x64, constraints = 0, level = 0, dot = 0;
+    u_char *c;
+
+    if (rendition->profile.len == 8 && ngx_strncmp(rendition->profile.data, "baseline", 8) == 0) {
+        profile = 0x42;
+        constraints = 0xc0;
+    } else if (rendition->profile.len == 4 && ngx_strncmp(rendition->profile.data, "main", 4) == 0) {
+        profile = 0x4d;
+        constraints = 0x40;
+    }
+    /* level_idc is ten times the level: 3.1, 31 and 3 give 31, 31 and 30 */
+    for (c = rendition->level.data; c < rendition->level.data + rendition->level.len; c++) {
+        if (*c == '.') dot = 1;
+        else if (*c >= '0' && *c <= '9') level = level * 10 + *c - '0';
+    }
+    if (!dot && level < 10) level *= 10;
+    if (level == 0) level = 30;
+    return ngx_sprintf(p, "avc1.%02xi%02xi%02xi", profile, constraints, level);
+}
+
+/* CODECS attribute of a variant, the source itself when rendition is NULL */
+static u_char *m3u8_codecs(moov_t const *moov, ngx_http_estreaming_rendition_t const *rendition,
+        ngx_uint_t hevc, u_char *p) {
+    p = ngx_sprintf(p, "CODECS=\"");
+    if (rendition == NULL) {
+        p = m3u8_source_video_codec(moov, p);
+    } else if (hevc) {
+        p = ngx_sprintf(p, "hvc1.1.6.L%ui.B0",
+                ngx_estreaming_hevc_level(rendition->width, rendition->height));
     } else {
-        char *name = strrchr((const char *) mp4_context->file->name.data, '/') + 1;
-        filename = (char *) ngx_palloc(mp4_context->r->pool, name - (const char *) mp4_context->file->name.data);
-        strcpy(filename, (const char *) name);
+        p = m3u8_rung_video_codec(rendition, p);
     }
-    char *ext = strrchr(filename, '.');
-    *ext = 0;
-    // get video width, height
-    if (!moov_build_index(mp4_context, mp4_context->moov)) return 0;
-    moov_t const *moov = mp4_context->moov;
-    if (!options->adbr && !options->org) {
-        p = ngx_sprintf(p, "#EXT-X-ALLOW-CACHE:NO\n");
-        if (width >= 1920) {
-            p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=1560000,RESOLUTION=640x360,CODECS=\"mp4a.40.2, avc1.4d4015\"\n");
-            p = ngx_sprintf(p, "adbr/360p/%s.m3u8%s\n", filename, extra);
-            p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=3120000,RESOLUTION=854x480,CODECS=\"mp4a.40.2, avc1.4d4015\"\n");
-            p = ngx_sprintf(p, "adbr/480p/%s.m3u8%s\n", filename, extra);
-            p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=5120000,RESOLUTION=1280x720,CODECS=\"mp4a.40.2, avc1.4d4015\"\n");
-            p = ngx_sprintf(p, "adbr/720p/%s.m3u8%s\n", filename, extra);
-            p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=7680000,RESOLUTION=1920x1080,CODECS=\"mp4a.40.2, avc1.4d4015\"\n");
-            p = ngx_sprintf(p, "org/%s.m3u8%s\n", filename, extra);
-
-        } else if (width >= 1280) {
-            p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=1560000,RESOLUTION=640x360,CODECS=\"mp4a.40.2, avc1.4d4015\"\n");
-            p = ngx_sprintf(p, "adbr/360p/%s.m3u8%s\n", filename, extra);
-            p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=3120000,RESOLUTION=854x480,CODECS=\"mp4a.40.2, avc1.4d4015\"\n");
-            p = ngx_sprintf(p, "adbr/480p/%s.m3u8%s\n", filename, extra);
-            p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=5120000,RESOLUTION=1280x720,CODECS=\"mp4a.40.2, avc1.4d4015\"\n");
-            p = ngx_sprintf(p, "org/%s.m3u8%s\n", filename, extra);
-
-        } else if (width >= 854) {
-            p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=1560000,RESOLUTION=640x360,CODECS=\"mp4a.40.2, avc1.4d4015\"\n");
-            p = ngx_sprintf(p, "adbr/360p/%s.m3u8%s\n", filename);
-            p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=3120000,RESOLUTION=854x480,CODECS=\"mp4a.40.2, avc1.4d4015\"\n");
-            p = ngx_sprintf(p, "org/%s.m3u8%s\n", filename, extra);
-        } else {
-            p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=1560000,RESOLUTION=640x360,CODECS=\"mp4a.40.2, avc1.4d4015\"\n");
-            p = ngx_sprintf(p, "org/%s.m3u8%s\n", filename, extra);
-        }
-        result = 1;
+    if (rendition && rendition->audio_bitrate) {
+        p = ngx_sprintf(p, ",%s", rendition->audio_bitrate <= NGX_ESTREAMING_HE_AAC_MAX ?
+                "mp4a.40.5" : "mp4a.40.2");
     } else {
-        // http://developer.apple.com/library/ios/#technotes/tn2288/_index.html
-        //    if (!options->fragment_track_id) {
-        //        unsigned int audio_tracks;
-        //        unsigned int track_id;
-        //        audio_tracks = 0;
-        //        track_id = 0;
-        //        for (track_id = 0; track_id < moov->tracks_; ++track_id) {
-        //            if (moov->traks_[track_id]->mdia_->hdlr_->handler_type_ == FOURCC('s', 'o', 'u', 'n')) ++audio_tracks;
-        //        }
-        //        if (audio_tracks > 1) {
-        //            unsigned int i = 0;
-        //            for (track_id = 0; track_id < moov->tracks_; ++track_id) {
-        //                if (moov->traks_[track_id]->mdia_->hdlr_->handler_type_ == FOURCC('s', 'o', 'u', 'n')) {
-        //                    p = ngx_sprintf(p, "#EXT-X-MEDIA:TYPE=VIDEO,GROUP-ID=\"track\",NAME=\"%d\",DEFAULT=%s,URI=\"%s?audio=%d%s\"\n",
-        //                            track_id, i ? "YES" : "NO",
-        //                            filename, track_id, extra);
-        //                    ++i;
-        //                }
-        //            }
-        //            unsigned int bitrate = ((trak_bitrate(moov->traks_[0]) + 999) / 1000) * 1000;
-        //
-        //            p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,VIDEO=\"track\",BANDWIDTH=%ud\n", bitrate);
-        //            p = ngx_sprintf(p, "%s?audio=%d%s\n", filename, 1, extra);
-        //        }
-        //    }
+        p = m3u8_source_audio_codec(moov, p);
+    }
+    return ngx_sprintf(p, "\"\n");
+}
+
+/* seconds two media playlists may differ by at a cut and still be switched between */
+#define M3U8_ALIGN_TOLERANCE 0.1
+
+/*
+ * a pre-encoded rung is only offered when its media playlist cuts at the same
+ * times as the one of the source, or players would skip or repeat frames when
+ * switching
+ */
+static int m3u8_aligned(struct mp4_context_t *source, struct mp4_context_t *variant,
+        ngx_uint_t length) {
+    trak_t const *a, *b;
+    moov_segment_t sa, sb;
+    double ta, tb;
+    int na, nb;
 
+    if (!moov_build_index(source, source->moov) || !moov_build_index(variant, variant->moov))
+        return 0;
+    a = moov_segment_trak(source->moov);
+    b = moov_segment_trak(variant->moov);
+    if (a == NULL || b == NULL || !a->mdia_->mdhd_->timescale_ || !b->mdia_->mdhd_->timescale_)
+        return 0;
+    sa.last = NULL;
+    sb.last = NULL;
+    for (;;) {
+        na = moov_segment_next(a, length, &sa);
+        nb = moov_segment_next(b, length, &sb);
+        if (na != nb) return 0;
+        if (!na) return 1;
+        ta = (double) sa.last->pts_ / a->mdia_->mdhd_->timescale_;
+        tb = (double) sb.last->pts_ / b->mdia_->mdhd_->timescale_;
+        if (ta - tb > M3U8_ALIGN_TOLERANCE || tb - ta > M3U8_ALIGN_TOLERANCE) return 0;
+    }
+}
+
+/* pre-encoded rungs checked against their source by this worker */
+#define M3U8_VARIANT_CHECKS 64
+
+typedef struct {
+    ngx_file_uniq_t uniq; // the rung, then its source
+    time_t mtime;
+    off_t size;
+    ngx_file_uniq_t source_uniq;
+    time_t source_mtime;
+    off_t source_size;
+    ngx_uint_t length;
+    uint64_t clip_from;
+    uint64_t clip_to;
+    char const *failed; // why it is transcoded instead, NULL: listed
+    ngx_msec_t last_used;
+    unsigned used : 1;
+} m3u8_variant_check_t;
+
+static m3u8_variant_check_t m3u8_variant_checks[M3U8_VARIANT_CHECKS];
+
+/*
+ * the check of the rung against its source, *found tells whether it was done
+ * before; a new one takes the least recently used slot, NULL: no fd info
+ */
+static m3u8_variant_check_t *m3u8_variant_check(struct mp4_context_t *source,
+        struct mp4_context_t *variant, mp4_split_options_t const *options, int *found) {
+    m3u8_variant_check_t *check, *oldest = NULL;
+    ngx_file_info_t fi, sfi;
+    ngx_uint_t i;
+
+    if (ngx_fd_info(variant->file->fd, &fi) == NGX_FILE_ERROR
+            || ngx_fd_info(source->file->fd, &sfi) == NGX_FILE_ERROR) return NULL;
+    for (i = 0; i < M3U8_VARIANT_CHECKS; i++) {
+        check = &m3u8_variant_checks[i];
+        if (check->used && check->uniq == ngx_file_uniq(&fi)
+                && check->mtime == ngx_file_mtime(&fi) && check->size == ngx_file_size(&fi)
+                && check->source_uniq == ngx_file_uniq(&sfi)
+                && check->source_mtime == ngx_file_mtime(&sfi)
+                && check->source_size == ngx_file_size(&sfi)
+                && check->length == options->length && check->clip_from == options->clip_from
+                && check->clip_to == options->clip_to) {
+            check->last_used = ngx_current_msec;
+            *found = 1;
+            return check;
+        }
+        if (oldest == NULL || !check->used
+                || (oldest->used && check->last_used < oldest->last_used)) oldest = check;
+    }
+    ngx_memzero(oldest, sizeof (m3u8_variant_check_t));
+    oldest->uniq = ngx_file_uniq(&fi);
+    oldest->mtime = ngx_file_mtime(&fi);
+    oldest->size = ngx_file_size(&fi);
+    oldest->source_uniq = ngx_file_uniq(&sfi);
+    oldest->source_mtime = ngx_file_mtime(&sfi);
+    oldest->source_size = ngx_file_size(&sfi);
+    oldest->length = options->length;
+    oldest->clip_from = options->clip_from;
+    oldest->clip_to = options->clip_to;
+    oldest->last_used = ngx_current_msec;
+    oldest->used = 1;
+    *found = 0;
+    return oldest;
+}
 
+/*
+ * STREAM-INF of a pre-encoded rung from its own moov, NGX_DECLINED: transcode it.
+ * the reason is logged once per file by each worker, not on every playlist
+ */
+static ngx_int_t m3u8_variant(struct mp4_context_t *source,
+        mp4_split_options_t const *options, ngx_str_t const *path,
+        ngx_http_estreaming_rendition_t const *rendition, ngx_str_t const *name,
+        ngx_str_t const *query, u_char **out) {
+    ngx_http_request_t *r = source->r;
+    ngx_estreaming_source_rate_t rate;
+    struct mp4_context_t *variant;
+    m3u8_variant_check_t *check;
+    char const *failed = NULL;
+    ngx_str_t file;
+    int width, height, found = 0;
+    ngx_int_t rc;
+    u_char *p = *out;
 
+    if (ngx_estreaming_variant_path(r->pool, path, &rendition->name, &file) != NGX_OK)
+        return NGX_ERROR;
+    variant = ngx_estreaming_variant_open(r, &file);
+    if (variant == NULL) return NGX_DECLINED;
+    check = m3u8_variant_check(source, variant, options, &found);
+    if (found && check->failed) {
+        mp4_close(variant);
+        return NGX_DECLINED;
+    }
+    /* a clip of the source lists the same clip of the rung */
+    rc = moov_clip(variant, options);
+    if (rc == NGX_ERROR) {
+        mp4_close(variant);
+        return NGX_ERROR;
+    }
+    if (rc != NGX_OK) {
+        failed = "has nothing in the clip window";
+    } else if (!found && !m3u8_aligned(source, variant, options->length)) {
+        failed = "is not cut like its source";
+    } else if (ngx_estreaming_source_rate_cached(variant, options, &rate) != NGX_OK) {
+        failed = "has no video to measure";
+    }
+    if (failed) {
+        if (check) check->failed = failed;
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                "\"%V\" %s, transcoding rendition \"%V\" instead",
+                &file, failed, &rendition->name);
+        mp4_close(variant);
+        return NGX_DECLINED;
+    }
+    moov_video_size(variant->moov, &width, &height);
+    p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=%ui,AVERAGE-BANDWIDTH=%ui,",
+            ngx_estreaming_ts_rate(rate.video_peak + rate.audio_average),
+            ngx_estreaming_ts_rate(rate.video_average + rate.audio_average));
+    if (width > 0 && height > 0) {
+        p = ngx_sprintf(p, "RESOLUTION=%dx%d,", width, height);
+    }
+    p = m3u8_codecs(variant->moov, NULL, 0, p);
+    p = ngx_sprintf(p, "org/%V/%V.m3u8%V\n", &rendition->name, name, query);
+    mp4_close(variant);
+    *out = p;
+    return NGX_OK;
+}
+
+/*
+ * master playlist: the rungs narrower than the source, then the source.
+ * media playlist: one URL per segment of the video track, see moov_segment_next.
+ * the size of the output is bounded before anything is written, the
+ * playlist goes out from the single buffer it was written to
+ */
+int mp4_create_m3u8(struct mp4_context_t *mp4_context, struct bucket_t * bucket,
+        struct mp4_split_options_t *options, int width, int height, ngx_str_t path) {
+    ngx_http_request_t *r = mp4_context->r;
+    hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_estreaming_module);
+    ngx_str_t name, query, prefix = ngx_null_string;
+    /* the requested mp4, not the pre-encoded one a media playlist is built from */
+    ngx_str_t const *file = &path;
+    u_char *buffer, *p, *slash, *dot;
+    size_t size;
+    int result = 0;
+
+    if (!moov_build_index(mp4_context, mp4_context->moov)) return 0;
+    moov_t const *moov = mp4_context->moov;
+
+    /* playlist name without extension, absolute unless streaming_relative */
+    dot = file->data + file->len;
+    while (dot > file->data && *dot != '.') dot--;
+    if (conf->relative) {
+        for (slash = dot; slash > file->data && slash[-1] != '/'; slash--) { /* void */ }
+        name.data = slash;
+        name.len = dot - slash;
+    } else {
+        name.len = sizeof ("http://") - 1 + r->headers_in.server.len + (dot - file->data) - mp4_context->root;
+        name.data = ngx_pnalloc(r->pool, name.len);
+        if (name.data == NULL) return 0;
+        p = ngx_cpymem(name.data, "http://", sizeof ("http://") - 1);
+        p = ngx_cpymem(p, r->headers_in.server.data, r->headers_in.server.len);
+        ngx_memcpy(p, file->data + mp4_context->root, (dot - file->data) - mp4_context->root);
+    }
+    if (m3u8_query(r->pool, &r->args, options->adbr || options->org, &query) != NGX_OK) return 0;
+
+    if (!options->adbr && !options->org) {
         /*
-         remove query string as we rewrite it later
-         */
-        /* if proxy address is provided, use it
-         * can be use proxy address to point request to redirect (CDN) server
+         * every configured rung narrower than the source is served by the
+         * transcoder, or from its pre-encoded file, whatever the order of the
+         * ladder. the source itself is the top of the ladder and gets the
+         * bandwidth of the narrowest rung at least as wide, or its measured
+         * one with streaming_per_title
          */
-        if (conf->hls_proxy.data != NULL) {
-            ngx_http_core_loc_conf_t *clcf;
-            clcf = ngx_http_get_module_loc_conf(mp4_context->r, ngx_http_core_module);
-            strcpy(rewrite, "http://");
-            strcat(rewrite, (const char *) conf->hls_proxy.data);
-
-            if (ngx_strlen((char *) clcf->name.data) > 1) {
-                strcat(rewrite, (const char *) clcf->name.data);
-            }
+        ngx_http_estreaming_rendition_t *rendition = conf->renditions->elts;
+        ngx_estreaming_source_rate_t source, *measured = NULL;
+        ngx_estreaming_rung_t rung;
+        ngx_uint_t n, org_bandwidth = 7680000, org_width = 0, org_average = 0;
+        ngx_int_t rc;
+
+        /* an H.264 and an HEVC variant per rung at most, and the source */
+        size = sizeof ("#EXTM3U\n") + (2 * conf->renditions->nelts + 1)
+                * (M3U8_LINE_MAX + sizeof ("adbr//hevc/.m3u8\n") + NGX_ESTREAMING_RENDITION_NAME_MAX
+                + name.len + query.len);
+        buffer = ngx_pnalloc(r->pool, size);
+        if (buffer == NULL) return 0;
+        p = ngx_cpymem(buffer, "#EXTM3U\n", sizeof ("#EXTM3U\n") - 1);
+        if (conf->per_title
+                && ngx_estreaming_source_rate_cached(mp4_context, options, &source) == NGX_OK) {
+            measured = &source;
         }
-        if (options->adbr) {
-            replace(extra, "adbr=true&", "");
-            if (rewrite) {
-                strcat(rewrite, (const char*) "/adbr");
+        for (n = 0; n < conf->renditions->nelts; n++) {
+            if ((int) rendition[n].width >= width) {
+                if (org_width == 0 || rendition[n].width < org_width) {
+                    org_width = rendition[n].width;
+                    org_bandwidth = rendition[n].bandwidth;
+                }
+                continue;
+            }
+            if (conf->preencoded) {
+                rc = m3u8_variant(mp4_context, options, &path, &rendition[n], &name, &query, &p);
+                if (rc == NGX_ERROR) return 0;
+                if (rc == NGX_OK) continue;
+            }
+            ngx_estreaming_rung_rate(conf, &rendition[n], measured, &rung);
+            p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=%ui,", rung.bandwidth);
+            if (rung.average_bandwidth) {
+                p = ngx_sprintf(p, "AVERAGE-BANDWIDTH=%ui,", rung.average_bandwidth);
             }
-        } else {
-            replace(extra, "org=true", "");
-            if (rewrite) {
-                strcat(rewrite, (const char*) "/org");
+            p = ngx_sprintf(p, "RESOLUTION=%uix%ui,", rendition[n].width, rendition[n].height);
+            p = m3u8_codecs(moov, &rendition[n], 0, p);
+            p = ngx_sprintf(p, "adbr/%V/%V.m3u8%V\n", &rendition[n].name, &name, &query);
+            if (!rendition[n].hevc_bitrate || !ngx_estreaming_hevc) continue;
+            /* same rung in HEVC, players which cannot decode hvc1 skip it */
+            ngx_estreaming_rung_hevc(&rendition[n], &rung);
+            p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=%ui,", rung.bandwidth);
+            if (rung.average_bandwidth) {
+                p = ngx_sprintf(p, "AVERAGE-BANDWIDTH=%ui,", rung.average_bandwidth);
             }
+            p = ngx_sprintf(p, "RESOLUTION=%uix%ui,", rendition[n].width, rendition[n].height);
+            p = m3u8_codecs(moov, &rendition[n], 1, p);
+            p = ngx_sprintf(p, "adbr/%V/hevc/%V.m3u8%V\n", &rendition[n].name, &name, &query);
         }
-
-        switch (options->video_resolution) {
-
-            case R_360P:
-                replace(extra, "vr=360p", "");
-                if (conf->hls_proxy.data != NULL) strcat(rewrite, "/360p");
-                break;
-            case R_480P:
-                replace(extra, "vr=480p", "");
-                if (conf->hls_proxy.data != NULL) strcat(rewrite, "/480p");
-                //rewrite = "adbr/480p/";
-                break;
-            case R_720P:
-                replace(extra, "vr=720p", "");
-                if (conf->hls_proxy.data != NULL) strcat(rewrite, "/720p");
-                break;
+        if (measured) {
+            org_bandwidth = ngx_estreaming_ts_rate(source.video_peak + source.audio_average);
+            org_average = ngx_estreaming_ts_rate(source.video_average + source.audio_average);
         }
-        /* use ngx_strstr instead of strstr */
-        while (ngx_strstr(extra, "?&")) {
-            replace(extra, "?&", "?");
+        p = ngx_sprintf(p, "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=%ui,", org_bandwidth);
+        if (org_average) {
+            p = ngx_sprintf(p, "AVERAGE-BANDWIDTH=%ui,", org_average);
         }
-        if (ngx_strlen(extra) == 1) {
-            extra[0] = '\0';
+        if (width > 0 && height > 0) {
+            p = ngx_sprintf(p, "RESOLUTION=%dx%d,", width, height);
         }
-        trak_t const *trak = moov->traks_[0];
-        samples_t *cur = trak->samples_;
-        samples_t *prev = cur;
-        samples_t *last = trak->samples_ + trak->samples_size_ + 1;
-        p = ngx_sprintf(p, "#EXT-X-TARGETDURATION:%ud\n", conf->length + 3);
-        p = ngx_sprintf(p, "#EXT-X-MEDIA-SEQUENCE:0\n");
-        p = ngx_sprintf(p, "#EXT-X-VERSION:4\n");
-        //        p = ngx_sprintf(p, "#EXT-X-VERSION:3\n");
-        uint32_t i = 0, prev_i = 0;
-        while (cur != last) {
-            if (!cur->is_smooth_ss_) {
-                ++cur;
-                continue;
-            }
-            if (prev != cur) {
-                float duration = (float) ((cur->pts_ - prev->pts_) / (float) trak->mdia_->mdhd_->timescale_) + 0.0005;
-                if (duration >= (float) conf->length || cur + 1 == last) {
-                    p = ngx_sprintf(p, "#EXTINF:%.3f,\n", duration);
-                    if (conf->hls_proxy.data != NULL) {
-                        p = ngx_sprintf(p, "%s/%uD/%s.ts%s\n", rewrite, prev_i, filename, extra);
-                    } else {
-                        p = ngx_sprintf(p, "%uD/%s.ts%s\n", prev_i, filename, extra);
-                    }
-                    prev = cur;
-                    prev_i = i;
-                    ++result;
-                }
-            }
-            ++i;
-            ++cur;
-        }
-        p = ngx_sprintf(p, "#EXT-X-ENDLIST\n");
+        p = m3u8_codecs(moov, NULL, 0, p);
+        p = ngx_sprintf(p, "org/%V.m3u8%V\n", &name, &query);
+        bucket_append(bucket, buffer, p - buffer);
+        return 1;
     }
-    bucket_insert(bucket, buffer, p - buffer);
+
+    trak_t const *trak = moov_segment_trak(moov);
+    moov_segment_t segment;
+    uint64_t longest = 0;
+    /* the HEVC variant is fMP4: version 7 and an init segment */
+    char const *extension = options->hevc ? "m4s" : "ts";
+
+    if (trak == NULL || !trak->mdia_->mdhd_->timescale_) return 0;
+
     /*
-    if (buffer) {
-        ngx_pfree(mp4_context->r->pool, buffer);
+     * with streaming_hls_proxy URLs are absolute and point to the proxy:
+     * http://<proxy><location>/adbr|org[/<rendition>[/hevc]]/
+     */
+    if (conf->hls_proxy.data != NULL) {
+        ngx_http_core_loc_conf_t *clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+        prefix.data = ngx_pnalloc(r->pool, sizeof ("http:///adbr//hevc/") + conf->hls_proxy.len
+                + clcf->name.len + NGX_ESTREAMING_RENDITION_NAME_MAX);
+        if (prefix.data == NULL) return 0;
+        p = ngx_sprintf(prefix.data, "http://%V", &conf->hls_proxy);
+        if (clcf->name.len > 1) p = ngx_cpymem(p, clcf->name.data, clcf->name.len);
+        p = ngx_sprintf(p, options->adbr ? "/adbr" : "/org");
+        if (options->rendition) p = ngx_sprintf(p, "/%V", &options->rendition->name);
+        if (options->hevc) p = ngx_sprintf(p, "/hevc");
+        *p++ = '/';
+        prefix.len = p - prefix.data;
+    }
+
+    /* TARGETDURATION is the longest segment, not the one asked for */
+    segment.last = NULL;
+    while (moov_segment_next(trak, options->length, &segment)) {
+        if (segment.duration > longest) longest = segment.duration;
+        result++;
     }
-    if (filename != NULL) {
-        ngx_pfree(mp4_context->r->pool, filename);
+
+    size = 3 * M3U8_LINE_MAX + prefix.len + name.len + query.len
+            + result * (M3U8_LINE_MAX + prefix.len + NGX_INT32_LEN + name.len + query.len);
+    buffer = ngx_pnalloc(r->pool, size);
+    if (buffer == NULL) return 0;
+    p = ngx_sprintf(buffer, "#EXTM3U\n#EXT-X-TARGETDURATION:%ui\n#EXT-X-MEDIA-SEQUENCE:0\n",
+            moov_target_duration(trak, longest));
+    if (options->hevc) {
+        p = ngx_sprintf(p, "#EXT-X-VERSION:7\n#EXT-X-MAP:URI=\"%V%V.m4s%V\"\n", &prefix, &name, &query);
+    } else {
+        p = ngx_sprintf(p, "#EXT-X-VERSION:4\n");
     }
-    if (rewrite != NULL) {
-        ngx_pfree(mp4_context->r->pool, rewrite);
+    segment.last = NULL;
+    while (moov_segment_next(trak, options->length, &segment)) {
+        p = ngx_sprintf(p, "#EXTINF:%.3f,\n%V%uD/%V.%s%V\n",
+                (double) segment.duration / trak->mdia_->mdhd_->timescale_, &prefix,
+                segment.start, &name, extension, &query);
     }
-     */
+    p = ngx_sprintf(p, "#EXT-X-ENDLIST\n");
+    bucket_append(bucket, buffer, p - buffer);
     return result;
 }
 
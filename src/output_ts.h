@@ -681,35 +681,36 @@ static void write_audio_packet(mpegts_stream_t *mpegts_stream,
 
 ////////////////////////////////////////////////////////////////////////////////
 
-samples_t *get_next(trak_t const *trak, samples_t *sample, samples_t *last, u_int seconds, unsigned int *last_chunk) {
-    if (sample == last) return sample;
+/*
+ * keyframe ordinal of the segment following the one starting at fragment_start,
+ * same cut as the playlist. returns 0 when fragment_start is the last segment.
+ */
+u_int next_fragment_start(struct mp4_context_t *mp4_context, u_int fragment_start, u_int seconds) {
+    trak_t const *trak;
+    moov_segment_t segment;
 
-    samples_t *next = sample + 1;
-    u_int i = 0;
-    while (next != last) {
-        if (!next->is_smooth_ss_) {
-            ++next;
-            continue;
-        }
-        float duration = (float) ((next->pts_ - sample->pts_) / (float) trak->mdia_->mdhd_->timescale_) + 0.0005;
-        if (!(*last_chunk) && duration >= seconds) break;
-        if (*last_chunk && *last_chunk == i) break;
-        ++next;
-        ++i;
-    }
-    if (!(*last_chunk)) *last_chunk = i;
-    return next;
+    if (!moov_build_index(mp4_context, mp4_context->moov)) return 0;
+    trak = moov_segment_trak(mp4_context->moov);
+    if (trak == NULL || !moov_segment_at(trak, seconds, fragment_start, &segment)) return 0;
+    return segment.last == trak->samples_ + trak->samples_size_ ? 0 : segment.next;
 }
 
 int output_ts(struct mp4_context_t *mp4_context, struct bucket_t *bucket, struct mp4_split_options_t const *options) {
-    hls_conf_t *conf = ngx_http_get_module_loc_conf(mp4_context->r, ngx_http_estreaming_module);
     u_int audio = options->fragment_track_id ? options->fragment_track_id : 1;
     uint32_t mark_video = FOURCC('v', 'i', 'd', 'e'), mark_sound = FOURCC('s', 'o', 'u', 'n');
 
     moov_t const *moov = mp4_context->moov;
     if (!moov_build_index(mp4_context, mp4_context->moov)) return 0;
 
-    uint32_t track_id, i, audio_tracks = 0, last_track = 0, last_chunk = 0, max_fragment_size = 2;
+    uint32_t track_id, i, audio_tracks = 0, last_track = 0, max_fragment_size = 2;
+    trak_t const *video = moov_segment_trak(moov);
+    moov_segment_t segment;
+
+    /* the cut of the media playlist, audio takes as many sync samples */
+    if (video == NULL || !moov_segment_at(video, options->length, options->fragment_start, &segment)) {
+        MP4_ERROR("%s", "no video fragment");
+        return 0;
+    }
 
     fragment_t fragment[max_fragment_size];
     for (track_id = 0; track_id < max_fragment_size; ++track_id) fragment[track_id].trak = NULL;
@@ -751,7 +752,8 @@ int output_ts(struct mp4_context_t *mp4_context, struct bucket_t *bucket, struct
             if (end == 1 && last_track < max_fragment_size) {
                 fragment[last_track].trak = moov->traks_[track_id];
                 fragment[last_track].first = sample;
-                fragment[last_track].last = get_next(trak, sample, last, conf->length, &last_chunk);
+                fragment[last_track].last = trak == video ? segment.last
+                        : moov_skip_keyframes(sample, last, segment.next - segment.start);
                 //MP4_INFO("fragment begin %ld end %ld", sample->pts_, fragment[last_track].last->pts_);
                 ++last_track;
             }
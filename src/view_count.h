@@ -1,3 +1,4 @@
+/* mp4_context is NULL for playlists and segments served from the caches */
 extern void view_count(struct mp4_context_t *mp4_context, char *filename, char *hash, char action[50]) {
   // Your code. For example I send to server (via curl) the watching progress of video.
 }